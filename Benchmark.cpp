@@ -0,0 +1,323 @@
+#include "World.h"
+#include "Game.h"
+#include "Player.h"
+#include "perlinNoise3d.h"
+#include "perlinNoise3dHashed.h"
+#include <sstream>
+#include <vector>
+extern "C"{
+#include <clib/timemeas.h>
+}
+/** \file
+ * \brief Implements micro benchmarks of World's hot paths.
+ *
+ * The benchmarks run on the currently loaded CellVolumes, so the results reflect the terrain
+ * around the Player.  Results are written to the log.
+ */
+
+namespace dxtest{
+
+/// \brief Compares adjacency update implementations: a Cell at a time, apron snapshots and bitset kernels.
+///
+/// The bitset kernel is the AVX2 one if the build targets AVX2, the portable one otherwise.
+static void benchmarkAdjacency(World &world, std::ostream &o){
+	const int repeats = 4;
+	int count = 0;
+	int apronMismatches = 0, bitsMismatches = 0;
+	double recursive = 0., apron = 0., bits = 0.;
+	timemeas_t tm;
+	for(World::VolumeMap::iterator it = world.volume.begin(); it != world.volume.end(); it++){
+		CellVolume &cv = it->second;
+		if(cv.isUniform())
+			continue;
+
+		TimeMeasStart(&tm);
+		for(int i = 0; i < repeats; i++)
+			cv.updateAdjRecursive();
+		recursive += TimeMeasLap(&tm);
+		CellStorage reference = cv.getStorage();
+
+		TimeMeasStart(&tm);
+		for(int i = 0; i < repeats; i++){
+			CellApron buf;
+			cv.snapshot(buf);
+			cv.updateAdjApron(buf);
+		}
+		apron += TimeMeasLap(&tm);
+
+		for(int ix = 0; ix < CELLSIZE; ix++) for(int iy = 0; iy < CELLSIZE; iy++) for(int iz = 0; iz < CELLSIZE; iz++)
+			if(reference.get(ix, iy, iz) != cv.getStorage().get(ix, iy, iz))
+				apronMismatches++;
+
+		TimeMeasStart(&tm);
+		for(int i = 0; i < repeats; i++){
+			CellBitset solidFaces, waterFaces;
+			cv.updateAdjBits(solidFaces, waterFaces);
+		}
+		bits += TimeMeasLap(&tm);
+
+		for(int ix = 0; ix < CELLSIZE; ix++) for(int iy = 0; iy < CELLSIZE; iy++) for(int iz = 0; iz < CELLSIZE; iz++)
+			if(reference.get(ix, iy, iz) != cv.getStorage().get(ix, iy, iz))
+				bitsMismatches++;
+		cv.updateCache();
+		count++;
+	}
+	if(count == 0)
+		return;
+	o << "benchmark adjacency: " << count << " CellVolumes, per Cell " << recursive / count / repeats * 1e3
+		<< " ms, apron " << apron / count / repeats * 1e3 << " ms (" << apronMismatches << " mismatches), bitset "
+#ifdef __AVX2__
+		<< "(AVX2) "
+#endif
+		<< bits / count / repeats * 1e3 << " ms (" << bitsMismatches << " mismatches) per CellVolume" << std::endl;
+}
+
+/// \brief Measures access patterns that depend on CellLayout.
+///
+/// The layout is chosen at compile time, so build with each DXTEST_CELL_LAYOUT and compare logs.
+static void benchmarkLayout(World &world, const Vec3i &center, std::ostream &o){
+	const int repeats = 4;
+	timemeas_t tm;
+	int count = world.volume.size();
+	if(count == 0)
+		return;
+
+	TimeMeasStart(&tm);
+	for(int i = 0; i < repeats; i++)
+		for(World::VolumeMap::iterator it = world.volume.begin(); it != world.volume.end(); it++)
+			it->second.updateCache();
+	double update = TimeMeasLap(&tm);
+
+	// Walk scanlines like the first drawing pass does.
+	int visited = 0;
+	TimeMeasStart(&tm);
+	for(int i = 0; i < repeats; i++){
+		for(World::VolumeMap::iterator it = world.volume.begin(); it != world.volume.end(); it++){
+			const CellVolume &cv = it->second;
+			const CellVolume::ScanLinesType &scanLines = cv.getScanLines();
+			for(int ix = 0; ix < CELLSIZE; ix++) for(int iz = 0; iz < CELLSIZE; iz++)
+				for(int iy = scanLines[ix][iz][0]; iy < scanLines[ix][iz][1]; iy++)
+					visited += cv(ix, iy, iz).getAdjacents() < 6;
+		}
+	}
+	double scan = TimeMeasLap(&tm);
+
+	const int range = CELLSIZE * 2;
+	int solids = 0;
+	TimeMeasStart(&tm);
+	for(int ix = -range; ix < range; ix++) for(int iy = -range; iy < range; iy++) for(int iz = -range; iz < range; iz++)
+		solids += world.isSolid(center[0] + ix, center[1] + iy, center[2] + iz);
+	double solid = TimeMeasLap(&tm);
+
+	o << "benchmark layout " << CellLayout::name() << ": updateCache " << update / count / repeats * 1e3
+		<< " ms per CellVolume, scanline walk " << scan / count / repeats * 1e3
+		<< " ms per CellVolume (" << visited / repeats << " Cells), isSolid " << solid / (8 * range * range * range) * 1e9
+		<< " ns per call (" << solids << " solid)" << std::endl;
+}
+
+/// \brief Measures throughput of generating CellVolumes and of loading them from a stream.
+///
+/// A block of CellVolumes is created and removed when done.  Pass a scratch World, since
+/// creating and removing CellVolumes is recorded in its change journal.
+static void benchmarkStreaming(World &world, std::ostream &o){
+	const Vec3i origin(1 << 12, 0, 0);
+	std::vector<Vec3i> keys;
+	for(int ix = 0; ix < 4; ix++) for(int iy = 0; iy < 2; iy++) for(int iz = 0; iz < 4; iz++)
+		keys.push_back(Vec3i(origin[0] + ix, origin[1] + iy, origin[2] + iz));
+	const int count = int(keys.size());
+	timemeas_t tm;
+
+	TimeMeasStart(&tm);
+	for(int i = 0; i < count; i++)
+		world.emplaceVolume(keys[i]).initialize(keys[i]);
+	for(int i = 0; i < count; i++)
+		world.volume[keys[i]].updateCache();
+	double generate = TimeMeasLap(&tm);
+
+	std::stringstream ss;
+	for(int i = 0; i < count; i++){
+		world.volume[keys[i]].serialize(ss);
+		world.eraseVolume(keys[i]);
+	}
+
+	std::vector<CellVolume*> loaded;
+	TimeMeasStart(&tm);
+	for(int i = 0; i < count; i++)
+		loaded.push_back(world.unserializeVolume(ss));
+	for(int i = 0; i < count; i++)
+		loaded[i]->updateCache();
+	double load = TimeMeasLap(&tm);
+
+	for(int i = 0; i < count; i++)
+		world.eraseVolume(keys[i]);
+
+	o << "benchmark streaming: " << count << " CellVolumes, generation " << count / generate
+		<< " CellVolumes/s, load " << count / load << " CellVolumes/s" << std::endl;
+}
+
+/// \brief Compares Cells visited by walking scanlines and column masks on cave-heavy terrain.
+///
+/// Tunnels are dug through a block of CellVolumes created in a scratch World, so that many columns
+/// have Cells that need drawing both above and below a cave.  A scanline visits every Cell between
+/// them, while a column mask visits only the exposed ones.
+static void benchmarkColumns(World &world, std::ostream &o){
+	const Vec3i origin(1 << 12, 0, 1 << 12);
+	std::vector<Vec3i> keys;
+	for(int ix = 0; ix < 4; ix++) for(int iy = 0; iy < 2; iy++) for(int iz = 0; iz < 4; iz++)
+		keys.push_back(Vec3i(origin[0] + ix, origin[1] + iy, origin[2] + iz));
+	const int count = int(keys.size());
+	const int repeats = 16;
+	timemeas_t tm;
+
+	for(int i = 0; i < count; i++)
+		world.emplaceVolume(keys[i]).initialize(keys[i]);
+	for(int i = 0; i < count; i++)
+		world.volume[keys[i]].updateCache();
+
+	// Tunnels two Cells high along X and Z at several depths.
+	const Vec3i base = origin * CELLSIZE;
+	for(int y = 2; y < CELLSIZE * 2 - 2; y += 5) for(int j = 2; j < CELLSIZE * 4; j += 6) for(int k = 0; k < CELLSIZE * 4; k++){
+		for(int dy = 0; dy < 2; dy++){
+			world.setCell(base[0] + k, base[1] + y + dy, base[2] + j, Cell(Cell::Air));
+			world.setCell(base[0] + j, base[1] + y + dy, base[2] + k, Cell(Cell::Air));
+		}
+	}
+	world.updateDirtyVolumes();
+
+	int spanVisited = 0, maskVisited = 0, spanDrawn = 0, maskDrawn = 0;
+	TimeMeasStart(&tm);
+	for(int i = 0; i < repeats; i++){
+		for(int j = 0; j < count; j++){
+			const CellVolume &cv = world.volume[keys[j]];
+			const CellVolume::ScanLinesType &scanLines = cv.getScanLines();
+			for(int ix = 0; ix < CELLSIZE; ix++) for(int iz = 0; iz < CELLSIZE; iz++){
+				for(int iy = scanLines[ix][iz][0]; iy < scanLines[ix][iz][1]; iy++){
+					spanVisited++;
+					spanDrawn += cv.getSolidFaces(ix, iy, iz) != 0 && cv(ix, iy, iz).getType() != Cell::Air;
+				}
+			}
+		}
+	}
+	double span = TimeMeasLap(&tm);
+
+	TimeMeasStart(&tm);
+	for(int i = 0; i < repeats; i++){
+		for(int j = 0; j < count; j++){
+			const CellVolume &cv = world.volume[keys[j]];
+			const CellVolume::ColumnMasksType &columns = cv.getColumnMasks();
+			for(int ix = 0; ix < CELLSIZE; ix++) for(int iz = 0; iz < CELLSIZE; iz++){
+				for(unsigned bits = columns[ix][iz]; bits; bits &= bits - 1){
+					int iy = bitScanForward(bits);
+					maskVisited++;
+					maskDrawn += cv.getSolidFaces(ix, iy, iz) != 0 && cv(ix, iy, iz).getType() != Cell::Air;
+				}
+			}
+		}
+	}
+	double mask = TimeMeasLap(&tm);
+
+	for(int i = 0; i < count; i++)
+		world.eraseVolume(keys[i]);
+
+	o << "benchmark columns: " << count << " CellVolumes with caves, scanlines visit " << spanVisited / repeats
+		<< " Cells (" << spanDrawn / repeats << " drawn) in " << span / repeats * 1e3
+		<< " ms, column masks visit " << maskVisited / repeats
+		<< " Cells (" << maskDrawn / repeats << " drawn) in " << mask / repeats * 1e3 << " ms" << std::endl;
+}
+
+/// \brief Measures throughput of the material noise of each World::Generator on a single thread.
+///
+/// The parameters are those of CellVolume::initialize().  The hashed kernel is the AVX2 one if
+/// the build targets AVX2, the SSE4.1 one if it targets SSE4.1, the scalar one otherwise.
+static void benchmarkNoise(std::ostream &o){
+	const int blocks = 64;
+	static float field[CELLSIZE][CELLSIZE][CELLSIZE];
+	PerlinNoise::PerlinNoiseParams3D pnp(54123, 0.5);
+	pnp.octaves = 7;
+	pnp.yofs = 0;
+	pnp.zofs = 0;
+	PerlinNoise::FieldAssign3D<CELLSIZE> assign(field);
+	timemeas_t tm;
+
+	TimeMeasStart(&tm);
+	for(int i = 0; i < blocks; i++){
+		pnp.xofs = i * CELLSIZE;
+		PerlinNoise::perlin_noise_3D<CELLSIZE>(pnp, assign);
+	}
+	double lattice = TimeMeasLap(&tm);
+
+	TimeMeasStart(&tm);
+	for(int i = 0; i < blocks; i++){
+		pnp.xofs = i * CELLSIZE;
+		PerlinNoise::perlin_noise_3D_hashed<CELLSIZE>(pnp, assign);
+	}
+	double hashed = TimeMeasLap(&tm);
+
+	const double samples = double(blocks) * CELLSIZE * CELLSIZE * CELLSIZE;
+	o << "benchmark noise: " << pnp.octaves << " octaves, lattice " << samples / lattice / 1e6
+		<< " Msamples/s, hashed "
+#if defined(__AVX2__)
+		<< "(AVX2) "
+#elif defined(__SSE4_1__)
+		<< "(SSE4.1) "
+#endif
+		<< samples / hashed / 1e6 << " Msamples/s per core" << std::endl;
+}
+
+/// \brief Measures generation time of CellVolumes deep underground, at the surface and in the sky.
+///
+/// CellVolume::initialize() skips material noise above the surface and grassness deep down, so
+/// the three layers cost very differently.  The height fields are cached after the first layer.
+static void benchmarkGeneration(World &world, std::ostream &o){
+	static const int layers[3] = {-4, 0, 4};
+	static const char *const names[3] = {"deep", "surface", "sky"};
+	const int columns = 16;
+	timemeas_t tm;
+	o << "benchmark generation:";
+	for(int l = 0; l < 3; l++){
+		TimeMeasStart(&tm);
+		for(int i = 0; i < columns; i++){
+			Vec3i ci(1 << 13, layers[l], i);
+			CellVolume cv(&world, ci);
+			cv.initialize(ci);
+		}
+		o << (l ? "," : "") << " " << names[l] << " " << TimeMeasLap(&tm) / columns * 1e6 << " us";
+	}
+	o << " per CellVolume" << std::endl;
+}
+
+/// \brief Runs all benchmarks and writes the results to the log.
+void Game::benchmark(){
+#ifdef DXTEST_INSTRUMENT
+	// Counters are shared by all Worlds, so keep the counts of the game's frame aside and put
+	// them back after the benchmarks, discarding what the benchmarks counted.
+	long long counts[NumCounters], discarded[NumCounters];
+	Instrument::collect(counts);
+#endif
+
+	benchmarkAdjacency(*world, *logwriter);
+	benchmarkLayout(*world, World::real2ind(player->getPos()), *logwriter);
+
+	// CellVolumes created by benchmarks go to a scratch World, so that they neither show up in
+	// the change journal of the game's nor evict its cached height fields, and so that generation
+	// is timed with a cold HeightCache.  Constructing a World registers it to the Game, so undo it.
+	World *current = world;
+	{
+		World scratch(*this);
+		world = current;
+		scratch.generator = current->generator;
+		scratch.palettedStorage = current->palettedStorage;
+		benchmarkStreaming(scratch, *logwriter);
+		benchmarkColumns(scratch, *logwriter);
+		benchmarkGeneration(scratch, *logwriter);
+	}
+	benchmarkNoise(*logwriter);
+
+#ifdef DXTEST_INSTRUMENT
+	Instrument::collect(discarded);
+	for(int c = 0; c < NumCounters; c++)
+		Instrument::count(Counter(c), long(counts[c]));
+#endif
+}
+
+}
@@ -0,0 +1,59 @@
+#ifndef DXTEST_BITOPS_H
+#define DXTEST_BITOPS_H
+/** \file
+ * \brief Defines bit counting and scanning functions. Compilers have intrinsics for them, but under different names.
+ */
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace dxtest{
+
+/// \brief Returns the number of set bits in a 64-bit word.
+inline int popCount(unsigned long long v){
+#if defined(__GNUC__)
+	return __builtin_popcountll(v);
+#else
+	v = v - ((v >> 1) & 0x5555555555555555ULL);
+	v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+	v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return int((v * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+/// \brief Returns the index of the lowest set bit. The argument must not be zero.
+inline int bitScanForward(unsigned v){
+#if defined(__GNUC__)
+	return __builtin_ctz(v);
+#elif defined(_MSC_VER)
+	unsigned long ret;
+	_BitScanForward(&ret, v);
+	return int(ret);
+#else
+	int ret = 0;
+	while(!(v & 1))
+		v >>= 1, ret++;
+	return ret;
+#endif
+}
+
+/// \brief Returns the index of the highest set bit. The argument must not be zero.
+inline int bitScanReverse(unsigned v){
+#if defined(__GNUC__)
+	return 31 - __builtin_clz(v);
+#elif defined(_MSC_VER)
+	unsigned long ret;
+	_BitScanReverse(&ret, v);
+	return int(ret);
+#else
+	int ret = 0;
+	while(v >>= 1)
+		ret++;
+	return ret;
+#endif
+}
+
+}
+
+#endif
@@ -0,0 +1,54 @@
+#include "BlockPool.h"
+#include <map>
+/** \file
+ * \brief Implements BlockPool class.
+ */
+
+namespace dxtest{
+
+BlockPool::BlockPool(size_t blockSize, size_t blocksPerSlab) :
+	blockSize(blockSize < sizeof(FreeBlock) ? sizeof(FreeBlock) : blockSize),
+	blocksPerSlab(blocksPerSlab),
+	freeList(NULL),
+	capacity(0),
+	used(0)
+{
+	// Keep blocks aligned to pointer size, which is enough for everything we store.
+	this->blockSize = (this->blockSize + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*);
+}
+
+BlockPool::~BlockPool(){
+	for(std::vector<char*>::iterator it = slabs.begin(); it != slabs.end(); it++)
+		delete[] *it;
+}
+
+/// <summary>Makes sure at least given number of blocks can be allocated without a new slab.</summary>
+void BlockPool::reserve(size_t blocks){
+	if(used + blocks > capacity)
+		addSlab(used + blocks - capacity);
+}
+
+void BlockPool::addSlab(size_t blocks){
+	char *slab = new char[blockSize * blocks];
+	slabs.push_back(slab);
+	for(size_t i = blocks; 0 < i; i--){
+		FreeBlock *block = reinterpret_cast<FreeBlock*>(slab + blockSize * (i - 1));
+		block->next = freeList;
+		freeList = block;
+	}
+	capacity += blocks;
+}
+
+/// <summary>Returns the shared pool for given block size, creating it on first use.</summary>
+BlockPool &BlockPool::pool(size_t blockSize){
+	static std::map<size_t, BlockPool*> &pools = *new std::map<size_t, BlockPool*>;
+	BlockPool *&p = pools[blockSize];
+	if(!p){
+		// Aim at slabs of about 64 KB; large blocks get a slab of their own.
+		size_t perSlab = 0x10000 / blockSize;
+		p = new BlockPool(blockSize, perSlab ? perSlab : 1);
+	}
+	return *p;
+}
+
+}
@@ -0,0 +1,84 @@
+#ifndef DXTEST_BLOCKPOOL_H
+#define DXTEST_BLOCKPOOL_H
+/** \file
+ * \brief Defines BlockPool, the allocator of fixed size blocks for chunk payloads.
+ */
+
+#include <stddef.h>
+#include <vector>
+
+namespace dxtest{
+
+/// \brief Pool of fixed size memory blocks allocated in slabs.
+///
+/// Chunks come and go in large numbers while the Player moves, and every one of them allocates
+/// the same few sizes of payload.  Going to the heap for each of them fragments it and can stall
+/// in the allocator, so payloads are carved out of slabs instead, and freed blocks are kept in a
+/// free list to be recycled by the next chunk.  Slabs are never returned to the heap.
+///
+/// Pools for payloads are meant to live until the process exits, and chunks may be freed by
+/// static objects' destructors, so pool() deliberately never destroys the pools it creates.
+class BlockPool{
+public:
+	BlockPool(size_t blockSize, size_t blocksPerSlab = 16);
+	~BlockPool();
+
+	void *allocate();
+	void deallocate(void *p);
+	void reserve(size_t blocks);
+
+	size_t getBlockSize()const{return blockSize;}
+	size_t getCapacity()const{return capacity;} ///< Count of blocks in all slabs.
+	size_t getUsed()const{return used;} ///< Count of blocks currently allocated.
+
+	static BlockPool &pool(size_t blockSize);
+
+	/// \brief Returns the shared pool for a block size known at compile time.
+	///
+	/// pool(size_t) looks the size up in a map, so allocation paths get their pool from here,
+	/// which looks it up once and keeps it in a static local.
+	template<size_t BlockSize>
+	static BlockPool &pool(){
+		static BlockPool &p = pool(BlockSize);
+		return p;
+	}
+
+protected:
+	struct FreeBlock{
+		FreeBlock *next;
+	};
+	size_t blockSize;
+	size_t blocksPerSlab;
+	FreeBlock *freeList;
+	std::vector<char*> slabs;
+	size_t capacity;
+	size_t used;
+
+	void addSlab(size_t blocks);
+
+private:
+	BlockPool(const BlockPool &);
+	BlockPool &operator=(const BlockPool &);
+};
+
+inline void *BlockPool::allocate(){
+	if(!freeList)
+		addSlab(blocksPerSlab);
+	FreeBlock *block = freeList;
+	freeList = block->next;
+	used++;
+	return block;
+}
+
+inline void BlockPool::deallocate(void *p){
+	if(!p)
+		return;
+	FreeBlock *block = static_cast<FreeBlock*>(p);
+	block->next = freeList;
+	freeList = block;
+	used--;
+}
+
+}
+
+#endif
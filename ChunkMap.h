@@ -0,0 +1,290 @@
+#ifndef DXTEST_CHUNKMAP_H
+#define DXTEST_CHUNKMAP_H
+/** \file
+ * \brief Defines ChunkMap, the hash table that holds chunks keyed by their integer index.
+ */
+
+#include "BlockPool.h"
+#include "Instrument.h"
+#include <cpplib/vec3.h>
+#include <stddef.h>
+#include <utility>
+
+namespace dxtest{
+
+/// \brief Open addressing hash table keyed by chunk index vectors.
+///
+/// std::map needs O(log n) comparisons through a function pointer for every lookup, which
+/// hurts badly when every cross-border Cell access looks up the neighboring chunk.
+/// This table packs the index into a 64-bit key and probes linearly in a power-of-two slot
+/// array, so a lookup is usually a multiply, a shift and one or two cache lines.
+///
+/// Elements are allocated in individual nodes that never move, so pointers and references to
+/// elements stay valid until the element is erased.  The nodes are also chained in a doubly
+/// linked list in insertion order, which is what iterators walk, so an iterator remains valid
+/// through rehashing and through erasure of other elements, just like std::map.
+///
+/// The interface mimics the subset of std::map that we use.
+template<typename T>
+class ChunkMap{
+public:
+	typedef Vec3i key_type;
+	typedef T mapped_type;
+
+	/// \brief The element type, compatible with std::map's value_type in that it has first and second.
+	struct value_type{
+		const Vec3i first;
+		T second;
+		value_type(const Vec3i &key) : first(key), second(){}
+		value_type(const Vec3i &key, const T &value) : first(key), second(value){}
+		template<typename A1, typename A2>
+		value_type(const Vec3i &key, const A1 &a1, const A2 &a2) : first(key), second(a1, a2){}
+	};
+
+protected:
+	struct Node : value_type{
+		Node *prev;
+		Node *next;
+		Node(const Vec3i &key) : value_type(key), prev(NULL), next(NULL){}
+		Node(const Vec3i &key, const T &value) : value_type(key, value), prev(NULL), next(NULL){}
+		template<typename A1, typename A2>
+		Node(const Vec3i &key, const A1 &a1, const A2 &a2) : value_type(key, a1, a2), prev(NULL), next(NULL){}
+
+		/// Nodes are recycled through a BlockPool since chunks are created and freed all the time.
+		static void *operator new(size_t){return BlockPool::pool<sizeof(Node)>().allocate();}
+		static void operator delete(void *p){BlockPool::pool<sizeof(Node)>().deallocate(p);}
+	};
+
+	/// An empty slot is indicated by null node.
+	struct Slot{
+		unsigned long long key;
+		Node *node;
+	};
+
+	Slot *slots;
+	size_t mask; ///< Slot count minus 1. Slot count is always a power of 2.
+	size_t count;
+	Node *head;
+	Node *tail;
+
+public:
+	template<typename N, typename V>
+	class iterator_base{
+		N *node;
+		friend class ChunkMap;
+	public:
+		iterator_base(N *node = NULL) : node(node){}
+		template<typename N2, typename V2>
+		iterator_base(const iterator_base<N2, V2> &o) : node(o.node){}
+		V &operator*()const{return *node;}
+		V *operator->()const{return node;}
+		iterator_base &operator++(){node = node->next; return *this;}
+		iterator_base operator++(int){iterator_base ret = *this; node = node->next; return ret;}
+		bool operator==(const iterator_base &o)const{return node == o.node;}
+		bool operator!=(const iterator_base &o)const{return node != o.node;}
+		template<typename N2, typename V2> friend class iterator_base;
+	};
+	typedef iterator_base<Node, value_type> iterator;
+	typedef iterator_base<const Node, const value_type> const_iterator;
+
+	ChunkMap() : slots(NULL), mask(0), count(0), head(NULL), tail(NULL){
+		allocSlots(16);
+	}
+	~ChunkMap(){
+		clear();
+		delete[] slots;
+	}
+
+	iterator begin(){return iterator(head);}
+	iterator end(){return iterator();}
+	const_iterator begin()const{return const_iterator(head);}
+	const_iterator end()const{return const_iterator();}
+	size_t size()const{return count;}
+	bool empty()const{return count == 0;}
+
+	iterator find(const Vec3i &key){
+		return iterator(findNode(key));
+	}
+	const_iterator find(const Vec3i &key)const{
+		return const_iterator(findNode(key));
+	}
+
+	/// \brief Returns the element with given key, default-constructing it if it does not exist.
+	T &operator[](const Vec3i &key){
+		Node *node = findNode(key);
+		if(!node)
+			node = insertNode(new Node(key));
+		return node->second;
+	}
+
+	/// \brief Inserts given element if its key does not exist.
+	/// \returns The iterator to the element with the key and whether the insertion took place.
+	std::pair<iterator, bool> insert(const value_type &value){
+		Node *node = findNode(value.first);
+		if(node)
+			return std::pair<iterator, bool>(iterator(node), false);
+		return std::pair<iterator, bool>(iterator(insertNode(new Node(value.first, value.second))), true);
+	}
+
+	/// \brief Constructs an element in place from given arguments if its key does not exist.
+	///
+	/// Unlike insert(), this never copies T, so it works with non-copyable types.
+	/// \returns The iterator to the element with the key and whether the insertion took place.
+	template<typename A1, typename A2>
+	std::pair<iterator, bool> emplace(const Vec3i &key, const A1 &a1, const A2 &a2){
+		Node *node = findNode(key);
+		if(node)
+			return std::pair<iterator, bool>(iterator(node), false);
+		return std::pair<iterator, bool>(iterator(insertNode(new Node(key, a1, a2))), true);
+	}
+
+	void erase(iterator it);
+	size_t erase(const Vec3i &key){
+		Node *node = findNode(key);
+		if(!node)
+			return 0;
+		erase(iterator(node));
+		return 1;
+	}
+	void clear();
+
+	/// \brief Prepares room for given number of elements, so that inserting them never rehashes nor allocates nodes from the heap.
+	void reserve(size_t n){
+		size_t slotCount = mask + 1;
+		while(slotCount < n * 2)
+			slotCount *= 2;
+		if(mask + 1 < slotCount)
+			rehash(slotCount);
+		if(count < n)
+			BlockPool::pool<sizeof(Node)>().reserve(n - count);
+	}
+
+	/// \brief Packs chunk index into 64-bit key.
+	///
+	/// Each axis gets 21 bits, which covers more than a million chunks in each direction.
+	static unsigned long long packKey(const Vec3i &key){
+		return ((unsigned long long)(key[0] & 0x1fffff) << 42)
+			| ((unsigned long long)(key[1] & 0x1fffff) << 21)
+			| (unsigned long long)(key[2] & 0x1fffff);
+	}
+
+protected:
+	/// Fibonacci hashing; the upper bits of the product are well mixed.
+	size_t home(unsigned long long key)const{
+		return (size_t)((key * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+	}
+	void allocSlots(size_t n){
+		slots = new Slot[n];
+		for(size_t i = 0; i < n; i++)
+			slots[i].node = NULL;
+		mask = n - 1;
+	}
+	Node *findNode(const Vec3i &key)const{
+		unsigned long long k = packKey(key);
+		DXTEST_COUNT(ChunkLookups);
+		for(size_t i = home(k); slots[i].node; i = (i + 1) & mask){
+			DXTEST_COUNT(ChunkProbes);
+			if(slots[i].key == k)
+				return slots[i].node;
+		}
+		return NULL;
+	}
+	Node *insertNode(Node *node);
+	void placeSlot(unsigned long long key, Node *node){
+		size_t i = home(key);
+		while(slots[i].node)
+			i = (i + 1) & mask;
+		slots[i].key = key;
+		slots[i].node = node;
+	}
+	void rehash(size_t n);
+
+private:
+	ChunkMap(const ChunkMap &);
+	ChunkMap &operator=(const ChunkMap &);
+};
+
+
+
+// ----------------------------------------------------------------------------
+//                            Implementation
+// ----------------------------------------------------------------------------
+
+template<typename T>
+typename ChunkMap<T>::Node *ChunkMap<T>::insertNode(Node *node){
+	// Keep load factor at most 1/2 so that probe sequences stay short.
+	if(mask + 1 < (count + 1) * 2)
+		rehash((mask + 1) * 2);
+	placeSlot(packKey(node->first), node);
+	node->prev = tail;
+	node->next = NULL;
+	if(tail)
+		tail->next = node;
+	else
+		head = node;
+	tail = node;
+	count++;
+	return node;
+}
+
+template<typename T>
+void ChunkMap<T>::rehash(size_t n){
+	Slot *old = slots;
+	size_t oldsize = mask + 1;
+	allocSlots(n);
+	for(size_t i = 0; i < oldsize; i++)
+		if(old[i].node)
+			placeSlot(old[i].key, old[i].node);
+	delete[] old;
+}
+
+/// \brief Erases the element pointed to by given iterator.
+///
+/// Uses backward shift deletion instead of tombstones, so lookups never slow down
+/// after many insertions and erasures, which is exactly what chunk streaming does.
+template<typename T>
+void ChunkMap<T>::erase(iterator it){
+	Node *node = it.node;
+	unsigned long long k = packKey(node->first);
+	size_t i = home(k);
+	while(slots[i].node != node)
+		i = (i + 1) & mask;
+
+	// Shift following entries in the same cluster back if their home allows.
+	for(size_t j = (i + 1) & mask; slots[j].node; j = (j + 1) & mask){
+		size_t h = home(slots[j].key);
+		if(i <= j ? (h <= i || j < h) : (h <= i && j < h)){
+			slots[i] = slots[j];
+			i = j;
+		}
+	}
+	slots[i].node = NULL;
+
+	if(node->prev)
+		node->prev->next = node->next;
+	else
+		head = node->next;
+	if(node->next)
+		node->next->prev = node->prev;
+	else
+		tail = node->prev;
+	count--;
+	delete node;
+}
+
+template<typename T>
+void ChunkMap<T>::clear(){
+	for(Node *node = head; node;){
+		Node *next = node->next;
+		delete node;
+		node = next;
+	}
+	head = tail = NULL;
+	count = 0;
+	for(size_t i = 0; i <= mask; i++)
+		slots[i].node = NULL;
+}
+
+}
+
+#endif
@@ -20,6 +20,7 @@ public:
 
 	bool save();
 	bool load();
+	void benchmark();
 	void serialize(std::ostream &o);
 	void unserialize(std::istream &i);
 
@@ -0,0 +1,122 @@
+#include "World.h"
+#include "perlinNoise.h"
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+/** \file
+ * \brief Implements HeightCache, the cache of height fields of columns of CellVolumes.
+ */
+
+namespace dxtest{
+
+/// \brief The lock of a HeightCache, hidden here to keep platform headers out of World.h.
+struct HeightCache::Mutex{
+#ifdef _WIN32
+	CRITICAL_SECTION cs;
+	Mutex(){InitializeCriticalSection(&cs);}
+	~Mutex(){DeleteCriticalSection(&cs);}
+	void lock(){EnterCriticalSection(&cs);}
+	void unlock(){LeaveCriticalSection(&cs);}
+#else
+	pthread_mutex_t m;
+	Mutex(){pthread_mutex_init(&m, NULL);}
+	~Mutex(){pthread_mutex_destroy(&m);}
+	void lock(){pthread_mutex_lock(&m);}
+	void unlock(){pthread_mutex_unlock(&m);}
+#endif
+};
+
+namespace{
+
+/// \brief Holds a HeightCache::Mutex locked in its scope.
+template<typename M>
+class ScopedLock{
+	M &m;
+	ScopedLock(const ScopedLock &);
+	ScopedLock &operator=(const ScopedLock &);
+public:
+	ScopedLock(M &m) : m(m){m.lock();}
+	~ScopedLock(){m.unlock();}
+};
+
+unsigned long long packKey(int cx, int cz){
+	return (unsigned long long)(unsigned)cx << 32 | (unsigned)cz;
+}
+
+}
+
+HeightCache::HeightCache(int capacity) : mutex(new Mutex), capacity(capacity < 0 ? 0 : capacity), count(0), clock(0),
+	keys(this->capacity), lastUsed(this->capacity), entries(this->capacity)
+{
+}
+
+HeightCache::~HeightCache(){
+	delete mutex;
+}
+
+/// <summary>Returns the index of the entry with given key, or -1 if there is none.</summary>
+int HeightCache::find(unsigned long long key)const{
+	for(int i = 0; i < count; i++)
+		if(keys[i] == key)
+			return i;
+	return -1;
+}
+
+/// <summary>Copies the height field of a column, generating and caching it if it is not cached.</summary>
+/// <remarks>The lock is not held while generating, so threads missing different columns do not
+/// wait for each other.  If two threads miss the same column, both generate it and the first one
+/// to finish caches it.</remarks>
+void HeightCache::get(int cx, int cz, Field &field){
+	unsigned long long key = packKey(cx, cz);
+	{
+		ScopedLock<Mutex> lock(*mutex);
+		int i = find(key);
+		if(0 <= i){
+			lastUsed[i] = ++clock;
+			memcpy(field, entries[i].field, sizeof field);
+			DXTEST_COUNT(HeightCacheHits);
+			return;
+		}
+	}
+
+	DXTEST_COUNT(HeightCacheMisses);
+	generate(cx, cz, field);
+
+	ScopedLock<Mutex> lock(*mutex);
+	if(capacity == 0 || 0 <= find(key))
+		return;
+	int i = count;
+	if(count < capacity)
+		count++;
+	else{
+		i = 0;
+		for(int j = 1; j < count; j++)
+			if(clock - lastUsed[i] < clock - lastUsed[j])
+				i = j;
+	}
+	keys[i] = key;
+	lastUsed[i] = ++clock;
+	memcpy(entries[i].field, field, sizeof field);
+}
+
+/// <summary>Drops all cached height fields.</summary>
+void HeightCache::clear(){
+	ScopedLock<Mutex> lock(*mutex);
+	count = 0;
+}
+
+/// <summary>Generates the height field of a column with Perlin Noise.</summary>
+/// <remarks>Values are fractions of the height range; see CellVolume::initialize().</remarks>
+void HeightCache::generate(int cx, int cz, Field &field){
+	PerlinNoise::PerlinNoiseParams pnp(12321, 0.5);
+	pnp.octaves = 8;
+	pnp.xofs = cx * CELLSIZE;
+	pnp.yofs = cz * CELLSIZE;
+	PerlinNoise::FieldAssign<CELLSIZE> assign(field);
+	PerlinNoise::perlin_noise<CELLSIZE>(pnp, assign);
+}
+
+}
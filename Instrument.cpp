@@ -0,0 +1,78 @@
+#include "Instrument.h"
+#if defined(DXTEST_INSTRUMENT) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+/** \file
+ * \brief Implements Instrument class, which is empty unless DXTEST_INSTRUMENT is defined.
+ */
+
+#ifdef DXTEST_INSTRUMENT
+
+#ifdef _MSC_VER
+#define DXTEST_THREAD_LOCAL __declspec(thread)
+#else
+#define DXTEST_THREAD_LOCAL __thread
+#endif
+
+namespace dxtest{
+
+Instrument::Block Instrument::blocks[MaxThreads];
+
+static DXTEST_THREAD_LOCAL int threadSlot = 0; ///< 1 plus index of this thread's block, 0 if not assigned yet
+static volatile long threadCount = 0;
+
+/// <summary>Returns the block of counters of the calling thread, assigning one on first use.</summary>
+Instrument::Block &Instrument::local(){
+	if(!threadSlot){
+#ifdef _MSC_VER
+		long n = _InterlockedIncrement(&threadCount);
+#else
+		long n = __sync_add_and_fetch(&threadCount, 1);
+#endif
+		threadSlot = int((n - 1) % MaxThreads) + 1;
+	}
+	return blocks[threadSlot - 1];
+}
+
+/// <summary>Sums counters of all threads into totals and resets them.</summary>
+void Instrument::collect(long long (&totals)[NumCounters]){
+	for(int c = 0; c < NumCounters; c++)
+		totals[c] = 0;
+	for(int t = 0; t < MaxThreads; t++){
+		for(int c = 0; c < NumCounters; c++){
+			totals[c] += blocks[t].counts[c];
+			blocks[t].counts[c] = 0;
+		}
+	}
+}
+
+/// <summary>Writes counters summed since the last call to a stream in a line and resets them.</summary>
+void Instrument::report(std::ostream &o){
+	long long totals[NumCounters];
+	collect(totals);
+	for(int c = 0; c < NumCounters; c++)
+		o << (c ? ", " : "") << name(Counter(c)) << " = " << totals[c];
+	o << std::endl;
+}
+
+const char *Instrument::name(Counter c){
+	static const char *const names[NumCounters] = {
+		"cellInvokes",
+		"cellForeignInvokes",
+		"cellForeignExists",
+		"chunkLookups",
+		"chunkProbes",
+		"cacheRebuilds",
+		"cacheCellUpdates",
+		"cacheBorderUpdates",
+		"generations",
+		"generationsSkipped",
+		"heightCacheHits",
+		"heightCacheMisses",
+	};
+	return 0 <= c && c < NumCounters ? names[c] : "";
+}
+
+}
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef DXTEST_INSTRUMENT_H
+#define DXTEST_INSTRUMENT_H
+/** \file
+ * \brief Defines Instrument, the event counters of hot paths.
+ *
+ * Counters are compiled in only if DXTEST_INSTRUMENT is defined, for example by adding it to
+ * the preprocessor definitions of the project.  Otherwise DXTEST_COUNT() expands to nothing
+ * and Instrument's functions are empty, so the hot paths pay nothing.
+ */
+
+#include <ostream>
+
+namespace dxtest{
+
+/// \brief Events counted by Instrument.
+enum Counter{
+	CellInvokes, ///< CellVolume::operator() invocations
+	CellForeignInvokes, ///< CellVolume::operator() invocations that reached outside the CellVolume
+	CellForeignExists, ///< Foreign accesses that found a resident neighbor
+	ChunkLookups, ///< ChunkMap lookups by key
+	ChunkProbes, ///< Slots examined by ChunkMap lookups
+	CacheRebuilds, ///< Whole CellVolume cache rebuilds by CellVolume::updateCache()
+	CacheCellUpdates, ///< Cells updated by CellVolume::updateCacheCells()
+	CacheBorderUpdates, ///< Border layers updated by CellVolume::updateCacheBorder()
+	Generations, ///< CellVolumes generated by CellVolume::initialize()
+	GenerationsSkipped, ///< Generations that found the CellVolume above the surface and skipped material noise
+	HeightCacheHits, ///< Height fields found in HeightCache
+	HeightCacheMisses, ///< Height fields generated by HeightCache::get()
+	NumCounters
+};
+
+/// \brief Per-thread event counters that are summed up once a frame.
+///
+/// Each thread increments its own block of counters, so counting needs neither atomic
+/// operations nor locks, and threads do not contend for cache lines.  report() sums the
+/// blocks of all threads and resets them, so it should be called where no other thread is
+/// counting, such as at the end of a frame.
+class Instrument{
+public:
+#ifdef DXTEST_INSTRUMENT
+	static void count(Counter c, long n = 1){local().counts[c] += n;}
+	static void collect(long long (&totals)[NumCounters]);
+	static void report(std::ostream &o);
+	static const char *name(Counter c);
+
+	/// Maximum number of threads that can have their own blocks; further threads share them.
+	static const int MaxThreads = 16;
+
+protected:
+	/// Counters of a thread, padded to a cache line.
+	struct Block{
+		long long counts[(NumCounters + 7) / 8 * 8];
+	};
+	static Block blocks[MaxThreads];
+	static Block &local();
+#else
+	static void count(Counter, long = 1){}
+	static void report(std::ostream &){}
+#endif
+};
+
+}
+
+#ifdef DXTEST_INSTRUMENT
+#define DXTEST_COUNT(c) ::dxtest::Instrument::count(::dxtest::c)
+#define DXTEST_COUNT_N(c, n) ::dxtest::Instrument::count(::dxtest::c, (n))
+#else
+#define DXTEST_COUNT(c) ((void)0)
+#define DXTEST_COUNT_N(c, n) ((void)0)
+#endif
+
+#endif
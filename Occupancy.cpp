@@ -0,0 +1,332 @@
+#include "World.h"
+#include <string.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+/** \file
+ * \brief Implements occupancy bitsets of CellVolume and the adjacency kernels on them.
+ *
+ * Adjacency of a Cell is the number of its six neighbors in a bitset.  Instead of counting
+ * a Cell at a time, the neighbors of a whole row of Cells are obtained as six shifted or
+ * offset rows and summed with a bit-sliced adder, so each bit of the three resulting words is
+ * a bit of the count of the corresponding Cell.
+ *
+ * The AVX2 kernel processes a slice of constant X (16 rows) per instruction.  It is compiled in
+ * if the compiler targets AVX2 (/arch:AVX2 or -mavx2); otherwise the portable kernel processes
+ * four rows in a 64-bit word.
+ */
+
+namespace dxtest{
+
+namespace{
+
+typedef CellBitset::Row Row;
+
+/// \brief Rows of a bitset with a layer of rows from neighbors around them in X and Y.
+///
+/// Neighbors along Z are bits beyond the ends of rows, so they are stored separately as bits
+/// to be merged into shifted rows.  Corners are never referenced.
+struct BitsetApron{
+	Row rows[CELLSIZE + 2][CELLSIZE + 2];
+	Row zlo[CELLSIZE][CELLSIZE]; ///< Bit 0 set if the Cell at Z = -1 is set.
+	Row zhi[CELLSIZE][CELLSIZE]; ///< Bit 15 set if the Cell at Z = CELLSIZE is set.
+};
+
+/// \brief Word operations of the portable kernel, four rows at a time.
+struct Word64Ops{
+	typedef unsigned long long V;
+	static const int rows = 4;
+	static V load(const Row *p){V v; memcpy(&v, p, sizeof v); return v;}
+	static void store(Row *p, V v){memcpy(p, &v, sizeof v);}
+	static V and_(V a, V b){return a & b;}
+	static V or_(V a, V b){return a | b;}
+	static V xor_(V a, V b){return a ^ b;}
+	static V shl1(V a){return (a << 1) & 0xfffefffefffefffeULL;}
+	static V shr1(V a){return (a >> 1) & 0x7fff7fff7fff7fffULL;}
+};
+
+#ifdef __AVX2__
+/// \brief Word operations of the AVX2 kernel, a slice of 16 rows at a time.
+struct Avx2Ops{
+	typedef __m256i V;
+	static const int rows = 16;
+	static V load(const Row *p){return _mm256_loadu_si256((const __m256i*)p);}
+	static void store(Row *p, V v){_mm256_storeu_si256((__m256i*)p, v);}
+	static V and_(V a, V b){return _mm256_and_si256(a, b);}
+	static V or_(V a, V b){return _mm256_or_si256(a, b);}
+	static V xor_(V a, V b){return _mm256_xor_si256(a, b);}
+	static V shl1(V a){return _mm256_slli_epi16(a, 1);}
+	static V shr1(V a){return _mm256_srli_epi16(a, 1);}
+};
+typedef Avx2Ops KernelOps;
+#else
+typedef Word64Ops KernelOps;
+#endif
+
+/// \brief Counts neighbors of every Cell in a bitset into three bit planes of the count.
+template<typename Ops>
+void countNeighbors(const BitsetApron &a, CellBitset (&count)[3]){
+	typedef typename Ops::V V;
+	for(int ix = 0; ix < CELLSIZE; ix++) for(int iy = 0; iy < CELLSIZE; iy += Ops::rows){
+		V c = Ops::load(&a.rows[ix + 1][iy + 1]);
+		V n0 = Ops::load(&a.rows[ix][iy + 1]);
+		V n1 = Ops::load(&a.rows[ix + 2][iy + 1]);
+		V n2 = Ops::load(&a.rows[ix + 1][iy]);
+		V n3 = Ops::load(&a.rows[ix + 1][iy + 2]);
+		V n4 = Ops::or_(Ops::shl1(c), Ops::load(&a.zlo[ix][iy]));
+		V n5 = Ops::or_(Ops::shr1(c), Ops::load(&a.zhi[ix][iy]));
+
+		// Two full adders sum three inputs each into bits of weight 1 and 2.
+		V x01 = Ops::xor_(n0, n1);
+		V s012 = Ops::xor_(x01, n2);
+		V c012 = Ops::or_(Ops::and_(n0, n1), Ops::and_(n2, x01));
+		V x34 = Ops::xor_(n3, n4);
+		V s345 = Ops::xor_(x34, n5);
+		V c345 = Ops::or_(Ops::and_(n3, n4), Ops::and_(n5, x34));
+
+		// Sum the partial sums; weight 1 carries into weight 2, which carries into weight 4.
+		V carry = Ops::and_(s012, s345);
+		V x2 = Ops::xor_(c012, c345);
+		Ops::store(&count[0].rows[ix][iy], Ops::xor_(s012, s345));
+		Ops::store(&count[1].rows[ix][iy], Ops::xor_(x2, carry));
+		Ops::store(&count[2].rows[ix][iy], Ops::or_(Ops::and_(c012, c345), Ops::and_(carry, x2)));
+	}
+}
+
+}
+
+/// <summary>Copies a bitset of this CellVolume and a layer of the same bitset of neighbors into an apron.</summary>
+/// <remarks>Where a neighbor is not loaded, our own border is repeated, as operator() does.</remarks>
+static void fillApron(const CellBitset &own, const CellBitset *const (&nb)[6], BitsetApron &a){
+	static const int L = CELLSIZE - 1;
+	memset(a.rows, 0, sizeof a.rows);
+	for(int ix = 0; ix < CELLSIZE; ix++)
+		memcpy(&a.rows[ix + 1][1], own.rows[ix], sizeof own.rows[ix]);
+	for(int i = 0; i < CELLSIZE; i++){
+		a.rows[0][i + 1] = nb[0] ? nb[0]->rows[L][i] : own.rows[0][i];
+		a.rows[CELLSIZE + 1][i + 1] = nb[1] ? nb[1]->rows[0][i] : own.rows[L][i];
+		a.rows[i + 1][0] = nb[2] ? nb[2]->rows[i][L] : own.rows[i][0];
+		a.rows[i + 1][CELLSIZE + 1] = nb[3] ? nb[3]->rows[i][0] : own.rows[i][L];
+	}
+	for(int ix = 0; ix < CELLSIZE; ix++) for(int iy = 0; iy < CELLSIZE; iy++){
+		a.zlo[ix][iy] = Row(nb[4] ? nb[4]->rows[ix][iy] >> L & 1 : own.rows[ix][iy] & 1);
+		a.zhi[ix][iy] = Row(nb[5] ? (nb[5]->rows[ix][iy] & 1) << L : own.rows[ix][iy] & 1 << L);
+	}
+}
+
+/// <summary>Updates occupancy bits of a Cell after its type has changed.</summary>
+void CellVolume::setOccupancy(int ix, int iy, int iz, Cell::Type type){
+	Cell c(type);
+	opaque.set(ix, iy, iz, !c.isTranslucent());
+	solid.set(ix, iy, iz, c.isSolid());
+	water.set(ix, iy, iz, type == Cell::Water);
+
+	// Removing a solid Cell may empty its layer, which takes a row from each X to find out.
+	Row layer = 0;
+	for(int jx = 0; jx < CELLSIZE && !layer; jx++)
+		layer = solid.rows[jx][iy];
+	if(layer)
+		solidLayers |= 1 << iy;
+	else
+		solidLayers &= ~(1 << iy);
+}
+
+/// <summary>Rebuilds occupancy bitsets and summaries from Cells, after they have been generated or loaded.</summary>
+/// <remarks>The solid Cell count is derived from the bitset too.  The difference of the histogram
+/// is applied to World's totals, so regenerating a CellVolume never counts its Cells twice.</remarks>
+void CellVolume::updateOccupancy(){
+	int counts[Cell::NumTypes] = {0};
+	solidLayers = 0;
+	if(v.isUniform()){
+		Cell c = v.get(0, 0, 0);
+		opaque.fill(!c.isTranslucent());
+		solid.fill(c.isSolid());
+		water.fill(c.type == Cell::Water);
+		counts[c.type] = CellStorage::NumCells;
+		if(c.isSolid())
+			solidLayers = (1 << CELLSIZE) - 1;
+	}
+	else for(int ix = 0; ix < CELLSIZE; ix++) for(int iy = 0; iy < CELLSIZE; iy++){
+		Row o = 0, s = 0, w = 0;
+		for(int iz = 0; iz < CELLSIZE; iz++){
+			const Cell &c = v.get(ix, iy, iz);
+			o |= Row(!c.isTranslucent() << iz);
+			s |= Row(c.isSolid() << iz);
+			w |= Row((c.type == Cell::Water) << iz);
+			counts[c.type]++;
+		}
+		opaque.rows[ix][iy] = o;
+		solid.rows[ix][iy] = s;
+		water.rows[ix][iy] = w;
+		if(s)
+			solidLayers |= 1 << iy;
+	}
+	_solidcount = solid.count();
+	for(int i = 0; i < Cell::NumTypes; i++)
+		addBricks(Cell::Type(i), counts[i] - bricks[i]);
+}
+
+/// <summary>Resolves the CellVolume whose bitsets contain a Cell at most one step outside this CellVolume.</summary>
+/// <remarks>Indices are adjusted to the returned CellVolume.  Where the neighbor is not loaded,
+/// they are clamped to our own border, as operator() does.</remarks>
+const CellVolume &CellVolume::occupancyAt(int &ix, int &iy, int &iz)const{
+	int *const idx[3] = {&ix, &iy, &iz};
+	for(int a = 0; a < 3; a++){
+		int &i = *idx[a];
+		if(0 <= i && i < CELLSIZE)
+			continue;
+		const CellVolume *cv = neighbors[a * 2 + (0 < i)];
+		if(cv){
+			i -= i < 0 ? -CELLSIZE : CELLSIZE;
+			return *cv;
+		}
+		i = i < 0 ? 0 : CELLSIZE - 1;
+		return *this;
+	}
+	return *this;
+}
+
+/// <summary>Updates adjacency of all Cells from occupancy bitsets.</summary>
+/// <param name="solidFaces">Receives Cells that have any of their faces visible, i.e. non-Air Cells
+/// with 1 to 5 opaque neighbors.</param>
+/// <param name="waterFaces">Receives water Cells that have any face not covered by opaque Cells or water.</param>
+/// <remarks>Does the same thing as updateAdj() for every Cell.  Air Cells are skipped,
+/// since their adjacency is kept zero.</remarks>
+void CellVolume::updateAdjBits(CellBitset &solidFaces, CellBitset &waterFaces){
+	const CellBitset *opaqueNb[6], *waterNb[6];
+	for(int i = 0; i < 6; i++){
+		opaqueNb[i] = neighbors[i] ? &neighbors[i]->opaque : NULL;
+		waterNb[i] = neighbors[i] ? &neighbors[i]->water : NULL;
+	}
+	BitsetApron apron;
+	CellBitset adj[3], wadj[3];
+	fillApron(opaque, opaqueNb, apron);
+	countNeighbors<KernelOps>(apron, adj);
+	fillApron(water, waterNb, apron);
+	countNeighbors<KernelOps>(apron, wadj);
+
+	for(int ix = 0; ix < CELLSIZE; ix++) for(int iy = 0; iy < CELLSIZE; iy++){
+		Row a0 = adj[0].rows[ix][iy], a1 = adj[1].rows[ix][iy], a2 = adj[2].rows[ix][iy];
+		Row w0 = wadj[0].rows[ix][iy], w1 = wadj[1].rows[ix][iy], w2 = wadj[2].rows[ix][iy];
+		Row nonAir = Row(solid.rows[ix][iy] | water.rows[ix][iy]);
+
+		// adjacents is neither 0 nor 6 (binary 110).
+		solidFaces.rows[ix][iy] = Row(nonAir & (a0 | a1 | a2) & ~(a2 & a1 & ~a0));
+
+		// adjacents + adjacentWater is not 6, which also excludes either of them being 6.
+		Row k0 = Row(a0 & w0);
+		Row r1 = Row(a1 ^ w1 ^ k0), k1 = Row((a1 & w1) | (k0 & (a1 ^ w1)));
+		Row r2 = Row(a2 ^ w2 ^ k1), k2 = Row((a2 & w2) | (k1 & (a2 ^ w2)));
+		waterFaces.rows[ix][iy] = Row(water.rows[ix][iy] & ~(~(a0 ^ w0) & r1 & r2 & ~k2));
+
+		for(Row bits = nonAir; bits; bits &= bits - 1){
+			int iz = bitScanForward(bits);
+			Cell c = v.get(ix, iy, iz);
+			c.adjacents = char((a0 >> iz & 1) | (a1 >> iz & 1) << 1 | (a2 >> iz & 1) << 2);
+			c.adjacentWater = char((w0 >> iz & 1) | (w1 >> iz & 1) << 1 | (w2 >> iz & 1) << 2);
+			v.set(ix, iy, iz, c);
+		}
+	}
+}
+
+/// <summary>Extracts the rows of the six neighbors of a row of Cells in an apron.</summary>
+/// <remarks>The order is -X, +X, -Y, +Y, -Z and +Z, which is the order of face mask bits.</remarks>
+static void neighborRows(const BitsetApron &a, int ix, int iy, Row (&n)[6]){
+	Row c = a.rows[ix + 1][iy + 1];
+	n[0] = a.rows[ix][iy + 1];
+	n[1] = a.rows[ix + 2][iy + 1];
+	n[2] = a.rows[ix + 1][iy];
+	n[3] = a.rows[ix + 1][iy + 2];
+	n[4] = Row(c << 1 | a.zlo[ix][iy]);
+	n[5] = Row(c >> 1 | a.zhi[ix][iy]);
+}
+
+/// <summary>Stores exposed face masks of all non-Air Cells into the cache.</summary>
+/// <remarks>A face of a Cell is exposed to the solid pass if the neighbor across it is not opaque,
+/// and to the water pass if the neighbor is Air.  Masks of Air Cells are left zero, since they are
+/// never drawn.</remarks>
+void CellVolume::updateFaces(){
+	const CellBitset *opaqueNb[6], *solidNb[6], *waterNb[6];
+	for(int i = 0; i < 6; i++){
+		opaqueNb[i] = neighbors[i] ? &neighbors[i]->opaque : NULL;
+		solidNb[i] = neighbors[i] ? &neighbors[i]->solid : NULL;
+		waterNb[i] = neighbors[i] ? &neighbors[i]->water : NULL;
+	}
+	BitsetApron opaqueApron, nonAirApron, waterApron;
+	fillApron(opaque, opaqueNb, opaqueApron);
+	fillApron(solid, solidNb, nonAirApron);
+	fillApron(water, waterNb, waterApron);
+	for(int ix = 0; ix < CELLSIZE + 2; ix++) for(int iy = 0; iy < CELLSIZE + 2; iy++)
+		nonAirApron.rows[ix][iy] |= waterApron.rows[ix][iy];
+	for(int ix = 0; ix < CELLSIZE; ix++) for(int iy = 0; iy < CELLSIZE; iy++){
+		nonAirApron.zlo[ix][iy] |= waterApron.zlo[ix][iy];
+		nonAirApron.zhi[ix][iy] |= waterApron.zhi[ix][iy];
+	}
+
+	memset(scanLineCache->solidFaces, 0, sizeof scanLineCache->solidFaces);
+	memset(scanLineCache->waterFaces, 0, sizeof scanLineCache->waterFaces);
+	for(int ix = 0; ix < CELLSIZE; ix++) for(int iy = 0; iy < CELLSIZE; iy++){
+		Row nonAir = Row(solid.rows[ix][iy] | water.rows[ix][iy]);
+		if(!nonAir)
+			continue;
+		Row on[6], nn[6];
+		neighborRows(opaqueApron, ix, iy, on);
+		neighborRows(nonAirApron, ix, iy, nn);
+		for(Row bits = nonAir; bits; bits &= bits - 1){
+			int iz = bitScanForward(bits);
+			int solidMask = 0, waterMask = 0;
+			for(int d = 0; d < 6; d++){
+				solidMask |= (~on[d] >> iz & 1) << d;
+				waterMask |= (~nn[d] >> iz & 1) << d;
+			}
+			scanLineCache->solidFaces[ix][iy][iz] = (unsigned char)solidMask;
+			scanLineCache->waterFaces[ix][iy][iz] = (unsigned char)waterMask;
+		}
+	}
+}
+
+/// <summary>Updates exposed face masks of a Cell in the cache from occupancy bitsets.</summary>
+/// <remarks>The cache must be allocated.  Used when a single Cell or its neighbor has changed.</remarks>
+void CellVolume::updateCellFaces(int ix, int iy, int iz){
+	int solidMask = 0, waterMask = 0;
+	if(solid.get(ix, iy, iz) || water.get(ix, iy, iz)){
+		for(int d = 0; d < 6; d++){
+			int jx = ix + (d == 0 ? -1 : d == 1), jy = iy + (d == 2 ? -1 : d == 3), jz = iz + (d == 4 ? -1 : d == 5);
+			const CellVolume &cv = occupancyAt(jx, jy, jz);
+			if(!cv.opaque.get(jx, jy, jz))
+				solidMask |= 1 << d;
+			if(!cv.solid.get(jx, jy, jz) && !cv.water.get(jx, jy, jz))
+				waterMask |= 1 << d;
+		}
+	}
+	scanLineCache->solidFaces[ix][iy][iz] = (unsigned char)solidMask;
+	scanLineCache->waterFaces[ix][iy][iz] = (unsigned char)waterMask;
+}
+
+/// <summary>Builds column masks and scanline tables from bitsets of Cells that need drawing.</summary>
+/// <remarks>Bitsets have rows along Z, while columns run along Y, so the bits are transposed
+/// a set bit at a time; scanlines are then just the lowest and highest bits of each column.</remarks>
+/// <returns>Whether any scanline is not empty.</returns>
+bool CellVolume::buildScanLines(const CellBitset &solidFaces, const CellBitset &waterFaces){
+	const CellBitset *faces[2] = {&solidFaces, &waterFaces};
+	ColumnMasksType *columnTables[2] = {&scanLineCache->solidColumns, &scanLineCache->tranColumns};
+	ScanLinesType *tables[2] = {&scanLineCache->solid, &scanLineCache->tran};
+	bool any = false;
+	for(int t = 0; t < 2; t++){
+		ColumnMasksType &columns = *columnTables[t];
+		ScanLinesType &table = *tables[t];
+		memset(columns, 0, sizeof columns);
+		for(int ix = 0; ix < CELLSIZE; ix++){
+			for(int iy = 0; iy < CELLSIZE; iy++)
+				for(Row bits = faces[t]->rows[ix][iy]; bits; bits &= bits - 1)
+					columns[ix][bitScanForward(bits)] |= 1 << iy;
+			for(int iz = 0; iz < CELLSIZE; iz++){
+				setScanLine(table[ix][iz], columns[ix][iz]);
+				any = any || columns[ix][iz];
+			}
+		}
+	}
+	return any;
+}
+
+}
@@ -48,7 +48,9 @@ void Player::think(double dt){
 	// Check if the Player's feet are under ground, and if they do, gradually climb up to prevent stucking.
 	if(moveMode == Walk) for(int ix = 0; ix < 2; ix++) for(int iz = 0; iz < 2; iz++){
 		Vec3d hitcheck(pos[0] + (ix * 2 - 1) * boundWidth, pos[1] - eyeHeight, pos[2] + (iz * 2 - 1) * boundLength);
-		if(game.world->isSolid(hitcheck)){
+		// Feet above the surface are never in solid cells, which the heightmap tells without looking up CellVolumes.
+		Vec3i ihitcheck = game.world->real2ind(hitcheck);
+		if(ihitcheck[1] <= game.world->surfaceHeight(ihitcheck[0], ihitcheck[2]) && game.world->isSolid(hitcheck)){
 			trymove(Vec3d(0, 2. * dt, 0), false, true);
 			ix = 2; // Exit outer iteration
 			break;
@@ -213,6 +215,9 @@ void Player::keyinput(double dt){
 	if(oldKeys['M'] & 0x80 && !(GetKeyState('M') >> 8))
 		showMiniMap = !showMiniMap;
 
+	if(oldKeys['B'] & 0x80 && !(GetKeyState('B') >> 8))
+		game.benchmark();
+
 	memcpy(oldKeys, keys, sizeof oldKeys);
 }
 
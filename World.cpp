@@ -3,11 +3,15 @@
 #include "Player.h"
 #include "perlinNoise.h"
 #include "perlinNoise3d.h"
+#include "perlinNoise3dHashed.h"
 #include <cpplib/vec3.h>
 #include <cpplib/vec4.h>
 #include <cpplib/quat.h>
 #include <math.h>
+#include <string.h>
 #include <vector>
+#include <algorithm>
+#include <stdexcept>
 /** \file
  * \brief Implements World class.
  */
@@ -19,34 +23,250 @@ namespace dxtest{
 const Cell CellVolume::v0(Cell::Air);
 
 
-int CellVolume::cellInvokes = 0;
-int CellVolume::cellForeignInvokes = 0;
-int CellVolume::cellForeignExists = 0;
+CellStorage::CellStorage(bool paletted) : full(NULL), indices(NULL), bits(0), paletted(paletted){
+	palette.push_back(Cell());
+}
+
+CellStorage::CellStorage(const CellStorage &o) : full(NULL), indices(NULL){
+	*this = o;
+}
+
+CellStorage::~CellStorage(){
+	release();
+}
+
+CellStorage &CellStorage::operator=(const CellStorage &o){
+	if(this == &o)
+		return *this;
+	release();
+	palette = o.palette;
+	bits = o.bits;
+	paletted = o.paletted;
+	if(o.full){
+		full = allocFull();
+		memcpy(full, o.full, NumCells * sizeof *full);
+	}
+	else if(o.indices){
+		indices = allocIndices(bits);
+		memcpy(indices, o.indices, NumCells * bits / 8);
+	}
+	return *this;
+}
+
+/// <summary>Fills the whole storage with a Cell, making it uniform.</summary>
+void CellStorage::fill(const Cell &c){
+	release();
+	palette.assign(1, c);
+}
+
+/// <summary>Re-encodes the indices with given number of bits per index.</summary>
+void CellStorage::setBits(int newbits){
+	unsigned char *old = indices;
+	int oldbits = bits;
+	indices = allocIndices(newbits);
+	memset(indices, 0, NumCells * newbits / 8);
+	bits = newbits;
+	if(old){
+		for(int i = 0; i < NumCells; i++)
+			setIndex(i, (old[i * oldbits >> 3] >> (i * oldbits & 7)) & ((1 << oldbits) - 1));
+		indexPool(oldbits).deallocate(old);
+	}
+}
+
+/// <summary>Expands paletted storage into plain Cell array.</summary>
+void CellStorage::toFull(){
+	full = allocFull();
+	for(int i = 0; i < NumCells; i++)
+		full[i] = palette[getIndex(i)];
+	if(indices)
+		indexPool(bits).deallocate(indices);
+	indices = NULL;
+	bits = 0;
+	std::vector<Cell>().swap(palette);
+}
+
+/// <summary>Drops unused palette entries and shrinks the index width.</summary>
+/// <remarks>
+/// Palette entries are never removed by set(), so cache updates that rewrite adjacency
+/// values leave stale entries behind.  Call this after bulk modifications.
+/// A storage that had fallen back to plain array returns to paletted mode if possible.
+/// Without palette, this only detects plain arrays that turned uniform.
+/// </remarks>
+void CellStorage::compact(){
+	if(!paletted){
+		if(full){
+			for(int i = 1; i < NumCells; i++)
+				if(full[i] != full[0])
+					return;
+			fill(Cell(full[0]));
+		}
+		return;
+	}
 
+	std::vector<Cell> newPalette;
+	unsigned char newIndex[NumCells];
+	if(full){
+		int last = 0;
+		for(int i = 0; i < NumCells; i++){
+			if(newPalette.empty() || !(newPalette[last] == full[i])){
+				for(last = 0; last < int(newPalette.size()); last++)
+					if(newPalette[last] == full[i])
+						break;
+				if(last == int(newPalette.size())){
+					if(last == MaxPaletteSize)
+						return; // Too many distinct Cells, stay in plain array.
+					newPalette.push_back(full[i]);
+				}
+			}
+			newIndex[i] = (unsigned char)last;
+		}
+	}
+	else{
+		int used[MaxPaletteSize] = {0};
+		int remap[MaxPaletteSize];
+		for(int i = 0; i < NumCells; i++)
+			used[getIndex(i)]++;
+		for(int p = 0; p < int(palette.size()); p++){
+			if(used[p]){
+				remap[p] = int(newPalette.size());
+				newPalette.push_back(palette[p]);
+			}
+		}
+		if(newPalette.size() == palette.size())
+			return; // Nothing to drop
+		for(int i = 0; i < NumCells; i++)
+			newIndex[i] = (unsigned char)remap[getIndex(i)];
+	}
+
+	int newbits = newPalette.size() <= 1 ? 0 : newPalette.size() <= 2 ? 1 : newPalette.size() <= 4 ? 2 : newPalette.size() <= 16 ? 4 : 8;
+	release();
+	bits = newbits;
+	if(bits){
+		indices = allocIndices(bits);
+		memset(indices, 0, NumCells * bits / 8);
+		for(int i = 0; i < NumCells; i++)
+			setIndex(i, newIndex[i]);
+	}
+	palette.swap(newPalette);
+}
+
+/// <summary>Returns the index arrays and the plain Cell array to their pools and makes the storage uniform.</summary>
+/// <remarks>The palette is left as is; callers replace it.</remarks>
+void CellStorage::release(){
+	if(full)
+		fullPool().deallocate(full);
+	if(indices)
+		indexPool(bits).deallocate(indices);
+	full = NULL;
+	indices = NULL;
+	bits = 0;
+}
+
+/// <summary>Reserves buffers in pools for given number of CellStorages with given bits per index.</summary>
+/// <remarks>Zero bits reserves nothing since uniform storages have no buffer.</remarks>
+void CellStorage::reserve(int bits, size_t count){
+	if(bits)
+		indexPool(bits).reserve(count);
+}
+
+size_t CellStorage::getMemoryUsage()const{
+	if(full)
+		return sizeof *this + NumCells * sizeof *full;
+	else
+		return sizeof *this + (indices ? NumCells * bits / 8 : 0) + palette.capacity() * sizeof(Cell);
+}
+
+
+const CellVolume::ScanLinesType CellVolume::emptyScanLines = {0};
+const CellVolume::ColumnMasksType CellVolume::emptyColumnMasks = {0};
+
+CellVolume::CellVolume(World *world, const Vec3i &ind) : world(world), index(ind), v(world ? world->palettedStorage : true), scanLineCache(NULL), _solidcount(0), solidLayers(0), modified(false), lastUsed(0), version(0){
+	opaque.fill(false);
+	solid.fill(false);
+	water.fill(false);
+	for(int i = 0; i < 6; i++)
+		neighbors[i] = NULL;
+	for(int i = 0; i < Cell::NumTypes; i++)
+		bricks[i] = 0;
+	addBricks(Cell::Air, CellStorage::NumCells);
+}
+
+CellVolume::~CellVolume(){
+	for(int i = 0; i < Cell::NumTypes; i++)
+		addBricks(Cell::Type(i), -bricks[i]);
+	delete scanLineCache;
+}
+
+/// <summary>Returns approximate memory used by this CellVolume, including the object itself.</summary>
+size_t CellVolume::getMemoryUsage()const{
+	return sizeof *this + v.getMemoryUsage() - sizeof v + (scanLineCache ? sizeof *scanLineCache : 0);
+}
+
+/// <summary>Generates channels of material noise with the generator of a World.</summary>
+/// <param name="first">The channel of the table that receives the first generated channel.</param>
+template<int N>
+static void generateMaterials(const World *world, const PerlinNoise::PerlinNoiseParams3D &pnp,
+	const unsigned long (&seeds)[N], float (&table)[CELLSIZE][CELLSIZE][CELLSIZE][4], int first)
+{
+	PerlinNoise::FieldAssignChannels3D<CELLSIZE, 4> assign(table, first);
+	if(world && world->generator == World::LatticeGenerator)
+		PerlinNoise::perlin_noise_3D_channels<CELLSIZE>(pnp, seeds, assign);
+	else
+		PerlinNoise::perlin_noise_3D_hashed_channels<CELLSIZE>(pnp, seeds, assign);
+}
 
 /// <summary>
 /// Initialize this CellVolume with Perlin Noise with given position index.
 /// </summary>
+/// <remarks>
+/// The height field tells before any 3D noise whether the CellVolume lies entirely above the
+/// surface, in which case it is filled with Air or Water without generating materials at all,
+/// or too deep for Grass, in which case grassness is not generated.
+/// </remarks>
 /// <param name="ci">The position of new CellVolume</param>
 void CellVolume::initialize(const Vec3i &ci){
-	float field[CELLSIZE][CELLSIZE];
+	DXTEST_COUNT(Generations);
+	HeightCache::Field field;
+	if(world)
+		world->heightCache.get(ci[0], ci[2], field);
+	else
+		HeightCache::generate(ci[0], ci[2], field);
 
-	PerlinNoise::PerlinNoiseParams3D pnp(12321, 0.5);
-	pnp.octaves = 8;
-	pnp.xofs = ci[0] * CELLSIZE;
-	pnp.yofs = ci[2] * CELLSIZE;
-	pnp.zofs = ci[1] * CELLSIZE;
-	PerlinNoise::perlin_noise<CELLSIZE>(pnp, PerlinNoise::FieldAssign<CELLSIZE>(field));
+	// The height is distance from the surface just below the cell of interest,
+	// can be negative when it's below surface.  These are heights of the bottom Cells.
+	int baseHeights[CELLSIZE][CELLSIZE];
+	int minBaseHeight = INT_MAX, maxBaseHeight = INT_MIN;
+	for(int ix = 0; ix < CELLSIZE; ix++) for(int iz = 0; iz < CELLSIZE; iz++){
+		int baseHeight = ci[1] * CELLSIZE - ((int)floor(field[ix][iz] * CELLSIZE * 4) - 16);
+		baseHeights[ix][iz] = baseHeight;
+		minBaseHeight = std::min(minBaseHeight, baseHeight);
+		maxBaseHeight = std::max(maxBaseHeight, baseHeight);
+	}
 
+	// Every Cell is above the surface, so the CellVolume is either all Air or all Water.
+	if(0 < minBaseHeight){
+		DXTEST_COUNT(GenerationsSkipped);
+		v.fill(Cell(ci[1] * CELLSIZE < 0 ? Cell::Water : Cell::Air));
+		updateOccupancy();
+		return;
+	}
+
+	PerlinNoise::PerlinNoiseParams3D pnp(12321, 0.5);
 	pnp.octaves = 7;
+	pnp.xofs = ci[0] * CELLSIZE;
 	pnp.yofs = ci[1] * CELLSIZE;
 	pnp.zofs = ci[2] * CELLSIZE;
-	float cellFactorTable[4][CELLSIZE][CELLSIZE][CELLSIZE];
+
+	// Grassness, dirtness, gravelness and rockness of each Cell, generated in one pass.
+	// Grass grows no deeper than 10 Cells, so grassness is never read if the top Cells are deeper.
+	float cellFactorTable[CELLSIZE][CELLSIZE][CELLSIZE][4];
 	const unsigned long seeds[4] = {54123, 112398, 93532, 3417453};
-	for(int i = 0; i < 4; i++){
-		pnp.seed = seeds[i];
-		PerlinNoise::perlin_noise_3D<CELLSIZE>(pnp, PerlinNoise::FieldAssign3D<CELLSIZE>(cellFactorTable[i]));
+	if(maxBaseHeight + CELLSIZE - 1 < -10){
+		const unsigned long deepSeeds[3] = {seeds[1], seeds[2], seeds[3]};
+		generateMaterials(world, pnp, deepSeeds, cellFactorTable, 1);
 	}
+	else
+		generateMaterials(world, pnp, seeds, cellFactorTable, 0);
 
 #if 0
 	int values[CELLSIZE][CELLSIZE][CELLSIZE] = {0};
@@ -73,22 +293,20 @@ void CellVolume::initialize(const Vec3i &ci){
 	}
 #endif
 
-	_solidcount = 0;
 	for(int ix = 0; ix < CELLSIZE; ix++) for(int iz = 0; iz < CELLSIZE; iz++){
-		// Compute the height first. The height is distance from the surface just below the cell of interest,
-		// can be negative when it's below surface.
-		int baseHeight = ci[1] * CELLSIZE - ((int)floor(field[ix][iz] * CELLSIZE * 4) - 16);
+		int baseHeight = baseHeights[ix][iz];
 
 		for(int iy = 0; iy < CELLSIZE; iy++){
 			int height = iy + baseHeight;
 
 			if(0 < height)
-				v[ix][iy][iz] = Cell(ci[1] * CELLSIZE + iy < 0 ? Cell::Water : Cell::Air);
+				v.set(ix, iy, iz, Cell(ci[1] * CELLSIZE + iy < 0 ? Cell::Water : Cell::Air));
 			else{
-				float grassness = 0 < height || height < -10 ? 0 : cellFactorTable[0][ix][iy][iz] / (1 << -height);
-				float dirtness = cellFactorTable[1][ix][iy][iz];
-				float gravelness = cellFactorTable[2][ix][iy][iz];
-				float rockness = cellFactorTable[3][ix][iy][iz] * (height < 0 ? 1.25 - 0.5 / (1. - height / 16.) : 0.75);
+				const float *factors = cellFactorTable[ix][iy][iz];
+				float grassness = 0 < height || height < -10 ? 0 : factors[0] / (1 << -height);
+				float dirtness = factors[1];
+				float gravelness = factors[2];
+				float rockness = factors[3] * (height < 0 ? 1.25 - 0.5 / (1. - height / 16.) : 0.75);
 
 				Cell::Type ct;
 				if (dirtness < grassness && gravelness < grassness && rockness < grassness)
@@ -99,25 +317,296 @@ void CellVolume::initialize(const Vec3i &ci){
 					ct = Cell::Gravel;
 				else
 					ct = Cell::Rock;
-				world->bricks[ct]++;
-				v[ix][iy][iz] = Cell(ct);
-				_solidcount++;
+				v.set(ix, iy, iz, Cell(ct));
 			}
 		}
 	}
-	for(int ix = 0; ix < CELLSIZE; ix++) for(int iy = 0; iy < CELLSIZE; iy++) for(int iz = 0; iz < CELLSIZE; iz++){
-		updateAdj(ix, iy, iz);
-	}
-
+	updateOccupancy();
 }
 
-World::World(Game &agame) : game(agame), volume(operator<){
+World::World(Game &agame) : game(agame), palettedStorage(true), generator(LatestGenerator), memoryBudget(64 << 20), volumeBudget(0),
+	swapFileName("dxtest.swp"), thinkCount(0), residentMemory(0), evictedVolumes(0), reloadedVolumes(0), changeEpoch(0)
+{
 	game.world = this;
 	for(int i = 0; i < Cell::NumTypes; i++)
 		bricks[i] = 0;
 }
 
 void World::initialize(){
+	int radius = Game::maxViewDistance / CELLSIZE;
+	reserve((2 * radius + 1) * (2 * radius + 1) * 2);
+}
+
+/// <summary>Pre-allocates memory for given number of CellVolumes from the pools.</summary>
+/// <remarks>
+/// Only half of them are assumed to need index arrays and scanline tables, since a layer of
+/// CellVolumes above or below the surface is usually uniform.  Pools grow on demand anyway,
+/// so this only saves allocations in the first frames.
+/// </remarks>
+void World::reserve(int chunks){
+	volume.reserve(chunks);
+	CellStorage::reserve(4, chunks / 2);
+	CellVolume::reserveScanLines(chunks / 2);
+}
+
+void CellVolume::reserveScanLines(size_t count){
+	BlockPool::pool<sizeof(ScanLineCache)>().reserve(count);
+}
+
+/// <summary>Constructs an empty CellVolume at given index in place and links it to its neighbors.</summary>
+/// <returns>The new CellVolume, or existing one if the index is already occupied.</returns>
+CellVolume &World::emplaceVolume(const Vec3i &ci){
+	std::pair<VolumeMap::iterator, bool> res = volume.emplace(ci, this, ci);
+	if(res.second){
+		linkVolume(res.first->second);
+		recordChange(res.first->second);
+	}
+	res.first->second.lastUsed = thinkCount;
+	return res.first->second;
+}
+
+/// <summary>Removes the CellVolume at given index after unlinking it from its neighbors.</summary>
+/// <remarks>Neighbors have the layer of Cells facing it marked dirty, since their border Cells
+/// are exposed differently without it, like think() does when a CellVolume appears.</remarks>
+bool World::eraseVolume(const Vec3i &ci){
+	VolumeMap::iterator it = volume.find(ci);
+	if(it == volume.end())
+		return false;
+	for(int dir = 0; dir < 6; dir++)
+		if(it->second.neighbors[dir])
+			markDirtyBorder(it->second.neighbors[dir]->index, dir ^ 1);
+	unlinkVolume(it->second);
+	removeSurface(it->second);
+	dirtyVolumes.erase(ci);
+	volume.erase(it);
+	recordChange(ci);
+	return true;
+}
+
+/// <summary>Records that a CellVolume index has appeared, disappeared or had its Cells changed.</summary>
+void World::recordChange(const Vec3i &ci){
+	changeJournal[ci] = ++changeEpoch;
+}
+
+/// <summary>Records that Cells of a resident CellVolume have changed and updates its version.</summary>
+void World::recordChange(CellVolume &cv){
+	cv.version = changeJournal[cv.index] = ++changeEpoch;
+}
+
+/// <summary>Lists indices of CellVolumes that have changed after given epoch.</summary>
+/// <remarks>Indices of CellVolumes that have been evicted since are included, so that consumers
+/// can drop what they derived from them.  Pass 0 to list all CellVolumes ever seen.</remarks>
+void World::getChangedVolumes(unsigned long long epoch, std::vector<Vec3i> &changed)const{
+	for(ChunkMap<unsigned long long>::const_iterator it = changeJournal.begin(); it != changeJournal.end(); it++)
+		if(epoch < it->second)
+			changed.push_back(it->first);
+}
+
+/// <summary>Reads a CellVolume serialized by CellVolume::serialize() directly into volume.</summary>
+/// <remarks>The cache is not updated, since it depends on neighbors that may follow in the stream.
+/// The CellVolume is regarded as modified, since it may differ from the generated one.</remarks>
+CellVolume *World::unserializeVolume(std::istream &is){
+	Vec3i ci;
+	if(!is.read((char*)&ci, sizeof ci))
+		return NULL;
+	CellVolume &cv = emplaceVolume(ci);
+	cv.unserializeCells(is);
+	cv.modified = true;
+	recordChange(cv);
+	return &cv;
+}
+
+bool World::openSwapFile(){
+	if(!swapFile.is_open())
+		swapFile.open(swapFileName.c_str(), std::ios_base::in | std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+	swapFile.clear();
+	return swapFile.is_open();
+}
+
+/// <summary>Adds a CellVolume that has been generated or loaded to the surface heightmap.</summary>
+/// <remarks>Resident CellVolumes in a column never overlap, so only columns whose surface is
+/// below this CellVolume need scanning.</remarks>
+void World::addSurface(const CellVolume &cv){
+	SurfaceColumn &column = surfaces[Vec3i(cv.index[0], 0, cv.index[2])];
+	int cy = cv.index[1];
+	std::vector<int>::iterator pos = column.volumes.begin();
+	while(pos != column.volumes.end() && cy < *pos)
+		pos++;
+	if(pos != column.volumes.end() && *pos == cy)
+		return;
+	column.volumes.insert(pos, cy);
+
+	if(cv.isAllAir())
+		return;
+	for(int ix = 0; ix < CELLSIZE; ix++) for(int iz = 0; iz < CELLSIZE; iz++){
+		if(cy * CELLSIZE <= column.height[ix][iz])
+			continue;
+		for(int iy = CELLSIZE - 1; 0 <= iy; iy--){
+			Cell::Type type = cv.v.get(ix, iy, iz).getType();
+			if(type != Cell::Air){
+				column.height[ix][iz] = cy * CELLSIZE + iy;
+				column.type[ix][iz] = (unsigned char)type;
+				break;
+			}
+		}
+	}
+}
+
+/// <summary>Removes a CellVolume that is about to be unloaded from the surface heightmap.</summary>
+void World::removeSurface(const CellVolume &cv){
+	SurfaceMap::iterator it = surfaces.find(Vec3i(cv.index[0], 0, cv.index[2]));
+	if(it == surfaces.end())
+		return;
+	SurfaceColumn &column = it->second;
+	int cy = cv.index[1];
+	std::vector<int>::iterator pos = std::find(column.volumes.begin(), column.volumes.end(), cy);
+	if(pos == column.volumes.end())
+		return;
+	column.volumes.erase(pos);
+	if(column.volumes.empty()){
+		surfaces.erase(it);
+		return;
+	}
+	for(int ix = 0; ix < CELLSIZE; ix++) for(int iz = 0; iz < CELLSIZE; iz++){
+		if(cy * CELLSIZE <= column.height[ix][iz] && column.height[ix][iz] < (cy + 1) * CELLSIZE)
+			scanSurface(column, cv.index[0], cv.index[2], ix, iz, cy * CELLSIZE - 1);
+	}
+}
+
+/// <summary>Updates the surface heightmap after a Cell at given world indices is assigned a type.</summary>
+void World::updateSurface(int ix, int iy, int iz, Cell::Type type){
+	int cx = SignDiv(ix, CELLSIZE), cz = SignDiv(iz, CELLSIZE);
+	SurfaceMap::iterator it = surfaces.find(Vec3i(cx, 0, cz));
+	if(it == surfaces.end())
+		return;
+	SurfaceColumn &column = it->second;
+	int lx = SignModulo(ix, CELLSIZE), lz = SignModulo(iz, CELLSIZE);
+	if(type != Cell::Air){
+		if(column.height[lx][lz] <= iy){
+			column.height[lx][lz] = iy;
+			column.type[lx][lz] = (unsigned char)type;
+		}
+	}
+	else if(column.height[lx][lz] == iy)
+		scanSurface(column, cx, cz, lx, lz, iy - 1);
+}
+
+/// <summary>Searches the top-most non-Air Cell at or below given world Y index in a column of resident CellVolumes.</summary>
+/// <param name="cx">X index of the CellVolumes in the column.</param>
+/// <param name="cz">Z index of the CellVolumes in the column.</param>
+/// <param name="ix">Local X index in the CellVolumes.</param>
+/// <param name="iz">Local Z index in the CellVolumes.</param>
+/// <param name="fromy">World Y index to start searching downward from.</param>
+void World::scanSurface(SurfaceColumn &column, int cx, int cz, int ix, int iz, int fromy){
+	column.height[ix][iz] = SurfaceColumn::NoSurface;
+	column.type[ix][iz] = Cell::Air;
+	for(std::vector<int>::iterator it = column.volumes.begin(); it != column.volumes.end(); it++){
+		if(fromy < *it * CELLSIZE)
+			continue;
+		VolumeMap::iterator vit = volume.find(Vec3i(cx, *it, cz));
+		if(vit == volume.end() || vit->second.isAllAir())
+			continue;
+		const CellStorage &v = vit->second.v;
+		for(int iy = std::min(fromy - *it * CELLSIZE, CELLSIZE - 1); 0 <= iy; iy--){
+			Cell::Type type = v.get(ix, iy, iz).getType();
+			if(type != Cell::Air){
+				column.height[ix][iz] = *it * CELLSIZE + iy;
+				column.type[ix][iz] = (unsigned char)type;
+				return;
+			}
+		}
+	}
+}
+
+static bool lessRecentlyUsed(const CellVolume *a, const CellVolume *b){
+	return a->getLastUsed() < b->getLastUsed();
+}
+
+/// <summary>Evicts least recently used CellVolumes until the resident ones fit in the budgets.</summary>
+/// <remarks>CellVolumes in the view radius have been touched in this think() and are never evicted,
+/// even if they alone exceed the budgets.
+///
+/// Summing memory usage visits every resident CellVolume, so it is done only every
+/// MemoryCheckInterval frames.  In between, residentMemory only drops by evicted CellVolumes,
+/// so CellVolumes loaded since the last sum may exceed the memory budget for that long.</remarks>
+void World::evictVolumes(){
+	if(memoryBudget && thinkCount % MemoryCheckInterval == 0){
+		residentMemory = 0;
+		for(VolumeMap::iterator it = volume.begin(); it != volume.end(); it++)
+			residentMemory += it->second.getMemoryUsage();
+	}
+	bool overMemory = memoryBudget && memoryBudget < residentMemory;
+	bool overCount = volumeBudget && volumeBudget < int(volume.size());
+	if(!overMemory && !overCount)
+		return;
+
+	std::vector<CellVolume*> candidates;
+	for(VolumeMap::iterator it = volume.begin(); it != volume.end(); it++)
+		if(it->second.lastUsed != thinkCount)
+			candidates.push_back(&it->second);
+	std::sort(candidates.begin(), candidates.end(), lessRecentlyUsed);
+
+	for(std::vector<CellVolume*>::iterator it = candidates.begin(); it != candidates.end(); it++){
+		if(!(memoryBudget && memoryBudget < residentMemory) && !(volumeBudget && volumeBudget < int(volume.size())))
+			break;
+		residentMemory -= std::min((*it)->getMemoryUsage(), residentMemory);
+		evictVolume(**it);
+	}
+}
+
+/// <summary>Removes a CellVolume from memory, writing it to the swap file first if it has been modified.</summary>
+/// <remarks>The swap file is only appended to, so the latest record of a CellVolume wins.
+/// If the swap file cannot be opened, the CellVolume is kept rather than losing modifications.</remarks>
+void World::evictVolume(CellVolume &cv){
+	if(cv.modified){
+		if(!openSwapFile())
+			return;
+		swapFile.seekp(0, std::ios_base::end);
+		std::streamoff pos = swapFile.tellp();
+		cv.serialize(swapFile);
+		if(!swapFile)
+			return;
+		swapIndex[cv.index] = pos;
+	}
+	eraseVolume(Vec3i(cv.index));
+	evictedVolumes++;
+}
+
+/// <summary>Reads an evicted CellVolume back from the swap file.</summary>
+/// <returns>The reloaded CellVolume, or NULL if it has never been written to the swap file.</returns>
+CellVolume *World::reloadVolume(const Vec3i &ci){
+	ChunkMap<std::streamoff>::iterator it = swapIndex.find(ci);
+	if(it == swapIndex.end() || !openSwapFile())
+		return NULL;
+	swapFile.seekg(it->second);
+	CellVolume *cv = unserializeVolume(swapFile);
+	if(cv){
+		// Identical to the swap file record, which stays valid until modified again.
+		cv->modified = false;
+		reloadedVolumes++;
+	}
+	return cv;
+}
+
+/// <summary>Connects neighbor links of a CellVolume that has just been added to volume.</summary>
+void World::linkVolume(CellVolume &cv){
+	for(int i = 0; i < 6; i++){
+		Vec3i ci = cv.index;
+		ci[i / 2] += i % 2 ? 1 : -1;
+		VolumeMap::iterator it = volume.find(ci);
+		cv.neighbors[i] = it != volume.end() ? &it->second : NULL;
+		if(cv.neighbors[i])
+			cv.neighbors[i]->neighbors[i ^ 1] = &cv;
+	}
+}
+
+/// <summary>Disconnects neighbor links of a CellVolume that is about to be removed from volume.</summary>
+void World::unlinkVolume(CellVolume &cv){
+	for(int i = 0; i < 6; i++){
+		if(cv.neighbors[i])
+			cv.neighbors[i]->neighbors[i ^ 1] = NULL;
+		cv.neighbors[i] = NULL;
+	}
 }
 
 /// <summary>
@@ -144,8 +633,9 @@ Vec3d World::ind2real(const Vec3i &ipos){
 /// <summary>Solidity check for given index coordinates</summary>
 bool World::isSolid(const Vec3i &v){
 	Vec3i ci(SignDiv(v[0], CELLSIZE), SignDiv(v[1], CELLSIZE), SignDiv(v[2], CELLSIZE));
-	if(volume.find(ci) != volume.end()){
-		CellVolume &cv = volume[ci];
+	VolumeMap::iterator it = volume.find(ci);
+	if(it != volume.end()){
+		CellVolume &cv = it->second;
 		return cv.isSolid(Vec3i(SignModulo(v[0], CELLSIZE), SignModulo(v[1], CELLSIZE), SignModulo(v[2], CELLSIZE)));
 	}
 	else
@@ -156,8 +646,15 @@ bool World::isSolid(const Vec3i &v){
 bool World::isSolid(const Vec3d &rv){
 	Vec3i v = real2ind(rv);
 	Vec3i ci(SignDiv(v[0], CELLSIZE), SignDiv(v[1], CELLSIZE), SignDiv(v[2], CELLSIZE));
-	if(volume.find(ci) != volume.end()){
-		CellVolume &cv = volume[ci];
+	VolumeMap::iterator it = volume.find(ci);
+	if(it != volume.end()){
+		CellVolume &cv = it->second;
+
+		// Summaries answer without touching Cells if the layer has no solid Cell or every Cell is opaque.
+		if(!(cv.getSolidLayers() >> SignModulo(v[1], CELLSIZE) & 1))
+			return false;
+		if(cv.isAllOpaque())
+			return true;
 		const Cell &c = cv(SignModulo(v[0], CELLSIZE), SignModulo(v[1], CELLSIZE), SignModulo(v[2], CELLSIZE));
 		return c.getType() & Cell::HalfBit ? rv[1] - floor(rv[1]) < .5 : c.isSolid();
 	}
@@ -169,9 +666,23 @@ bool World::isSolid(const Vec3d &rv){
 /// <remarks>The return value means how deep this point is from the surface. Only meaningful for solid cells.</remarks>
 double World::boundaryHeight(const Vec3d &rv){
 	Vec3i v = real2ind(rv);
+
+	// The top-most Cell is known from the heightmap without looking up the CellVolume.
+	SurfaceMap::iterator sit = surfaces.find(Vec3i(SignDiv(v[0], CELLSIZE), 0, SignDiv(v[2], CELLSIZE)));
+	if(sit != surfaces.end() && sit->second.height[SignModulo(v[0], CELLSIZE)][SignModulo(v[2], CELLSIZE)] == v[1])
+		return sit->second.type[SignModulo(v[0], CELLSIZE)][SignModulo(v[2], CELLSIZE)] & Cell::HalfBit ? ceil(rv[1] - .5) - (rv[1] - 0.5) : ceil(rv[1]) - rv[1];
+
 	Vec3i ci(SignDiv(v[0], CELLSIZE), SignDiv(v[1], CELLSIZE), SignDiv(v[2], CELLSIZE));
-	if(volume.find(ci) != volume.end()){
-		CellVolume &cv = volume[ci];
+	VolumeMap::iterator it = volume.find(ci);
+	if(it != volume.end()){
+		CellVolume &cv = it->second;
+
+		// Summaries answer without touching Cells if the layer has no solid Cell or every Cell is
+		// opaque, which excludes half-height Cells.
+		if(!(cv.getSolidLayers() >> SignModulo(v[1], CELLSIZE) & 1))
+			return 0.;
+		if(cv.isAllOpaque())
+			return ceil(rv[1]) - rv[1];
 		const Cell &c = cv(SignModulo(v[0], CELLSIZE), SignModulo(v[1], CELLSIZE), SignModulo(v[2], CELLSIZE));
 		return c.getType() & Cell::HalfBit ? ceil(rv[1] - .5) - (rv[1] - 0.5) : ceil(rv[1]) - rv[1];
 	}
@@ -180,6 +691,7 @@ double World::boundaryHeight(const Vec3d &rv){
 }
 
 void World::think(double dt){
+	thinkCount++;
 	Vec3i i = real2ind(game.player->getPos());
 	std::vector<CellVolume*> changed;
 	int radius = Game::maxViewDistance / CELLSIZE;
@@ -188,91 +700,383 @@ void World::think(double dt){
 			SignDiv((i[0] + ix * CELLSIZE), CELLSIZE),
 			SignDiv((i[1] + (2 * iy - 1) * CELLSIZE / 2), CELLSIZE),
 			SignDiv((i[2] + iz * CELLSIZE), CELLSIZE));
-		if(volume.find(ci) == volume.end()){
-			volume[ci] = CellVolume(this, ci);
-			CellVolume &cv = volume[ci];
-			cv.initialize(ci);
-			changed.push_back(&volume[ci]);
+		VolumeMap::iterator it = volume.find(ci);
+		if(it != volume.end())
+			it->second.lastUsed = thinkCount;
+		else{
+			CellVolume *cv = reloadVolume(ci);
+			if(!cv){
+				cv = &emplaceVolume(ci);
+				cv->initialize(ci);
+			}
+			changed.push_back(cv);
 		}
 	}
 
-	for(std::vector<CellVolume*>::iterator it = changed.begin(); it != changed.end(); it++)
-		(*it)->updateCache();
+	// Evict before the dirty pass, so that borders of neighbors facing evicted CellVolumes are
+	// refreshed in this frame.  CellVolumes created above are stamped with this frame and stay.
+	evictVolumes();
+
+	// New CellVolumes are built whole, while neighbors that were already resident only have
+	// the layer of Cells facing a new CellVolume refreshed, since nothing else of them depends on it.
+	// Edits since the last frame and borders facing evicted CellVolumes are coalesced into the same pass.
+	for(std::vector<CellVolume*>::iterator it = changed.begin(); it != changed.end(); it++){
+		addSurface(**it);
+		dirtyVolumes[(*it)->index].fill();
+		for(int dir = 0; dir < 6; dir++)
+			if((*it)->neighbors[dir])
+				markDirtyBorder((*it)->neighbors[dir]->index, dir ^ 1);
+	}
+	updateDirtyVolumes();
 }
 
+/// <summary>Finds Cells that need drawing in a column of Cells.</summary>
+/// <returns>Whether either of the masks is not zero.</returns>
+bool CellVolume::buildColumnMasks(int ix, int iz, unsigned short &solid, unsigned short &tran)const{
+	solid = tran = 0;
+	for (int iy = 0; iy < CELLSIZE; iy++)
+	{
+		const Cell &c = v.get(ix, iy, iz);
+		if (c.type != Cell::Air && (c.adjacents != 0 && c.adjacents != 6))
+			solid |= 1 << iy;
+
+		if(c.type == Cell::Water && c.adjacents != 6 && c.adjacentWater != 6 && c.adjacents + c.adjacentWater != 6)
+			tran |= 1 << iy;
+	}
+	return solid || tran;
+}
+
+/// <summary>Sets a scanline to the range from the lowest to the highest set bit of a column mask.</summary>
+void CellVolume::setScanLine(int (&line)[2], unsigned mask){
+	if(mask){
+		line[0] = bitScanForward(mask);
+		line[1] = bitScanReverse(mask) + 1;
+	}
+	else
+		line[0] = line[1] = 0;
+}
+
+/// <summary>Records a Cell to be updated by World::updateDirtyVolumes(), unless already recorded.</summary>
+void DirtyCells::add(int ix, int iy, int iz){
+	if(isFull())
+		return;
+	unsigned short packed = (unsigned short)(ix << 8 | iy << 4 | iz);
+	for(int i = 0; i < count; i++)
+		if(cells[i] == packed)
+			return;
+	if(count < MaxCells)
+		cells[count] = packed;
+	count++;
+}
+
+/// <summary>Marks a Cell at given world indices and its six neighbors as having stale cache.</summary>
+/// <remarks>Neighbors in CellVolumes that are not resident are ignored; they are never created.</remarks>
+void World::markDirtyCell(int ix, int iy, int iz){
+	static const int offsets[7][3] = {{0, 0, 0}, {-1, 0, 0}, {1, 0, 0}, {0, -1, 0}, {0, 1, 0}, {0, 0, -1}, {0, 0, 1}};
+	for(int d = 0; d < 7; d++){
+		int jx = ix + offsets[d][0], jy = iy + offsets[d][1], jz = iz + offsets[d][2];
+		Vec3i ci(SignDiv(jx, CELLSIZE), SignDiv(jy, CELLSIZE), SignDiv(jz, CELLSIZE));
+		if(volume.find(ci) == volume.end())
+			continue;
+		dirtyVolumes[ci].add(SignModulo(jx, CELLSIZE), SignModulo(jy, CELLSIZE), SignModulo(jz, CELLSIZE));
+	}
+}
+
+/// <summary>Marks a whole CellVolume as having stale cache, if it is resident.</summary>
+void World::markDirtyVolume(const Vec3i &ci){
+	if(volume.find(ci) != volume.end())
+		dirtyVolumes[ci].fill();
+}
+
+/// <summary>Marks the layer of Cells of a CellVolume facing given direction as having stale cache, if it is resident.</summary>
+void World::markDirtyBorder(const Vec3i &ci, int dir){
+	if(volume.find(ci) != volume.end())
+		dirtyVolumes[ci].borders |= 1 << dir;
+}
+
+/// <summary>Rebuilds caches of all CellVolumes marked dirty since the last call.</summary>
+/// <remarks>Called every think(), but can be called any time the caches need to be up to date.
+/// Caches depend only on occupancy bitsets, which setCell() keeps current, so the order
+/// of rebuilding does not matter.</remarks>
+void World::updateDirtyVolumes(){
+	for(ChunkMap<DirtyCells>::iterator it = dirtyVolumes.begin(); it != dirtyVolumes.end(); it++){
+		VolumeMap::iterator vit = volume.find(it->first);
+		if(vit == volume.end())
+			continue;
+		if(it->second.isFull())
+			vit->second.updateCache();
+		else{
+			for(int dir = 0; dir < 6; dir++)
+				if(it->second.borders & 1 << dir)
+					vit->second.updateCacheBorder(dir);
+			vit->second.updateCacheCells(it->second);
+		}
+	}
+	dirtyVolumes.clear();
+}
+
+/// <summary>Updates cache of a few changed Cells, touching only the Cells whose cache depends on them.</summary>
+/// <remarks>
+/// Adjacency of the Cells and the scanline columns containing them are recomputed.
+/// That is a few dozen Cell accesses per Cell instead of rebuilding whole CellVolumes.
+/// </remarks>
+void CellVolume::updateCacheCells(const DirtyCells &dirty){
+	DXTEST_COUNT_N(CacheCellUpdates, dirty.count);
+	for(int i = 0; i < dirty.count; i++){
+		unsigned short packed = dirty.cells[i];
+		updateCellCache(packed >> 8, packed >> 4 & 0xf, packed & 0xf);
+	}
+
+	// Adjacency updates leave stale palette entries behind, but compacting on every edit is
+	// as expensive as what we saved, so wait until the palette gets crowded.
+	if(CellStorage::MaxPaletteSize / 2 < v.getPaletteSize())
+		v.compact();
+}
+
+/// <summary>Updates cache of the layer of Cells facing a neighbor, after Cells of the neighbor on the other side have changed.</summary>
+/// <remarks>Cheaper than updateCache() since only 256 Cells and the columns containing them are examined.</remarks>
+void CellVolume::updateCacheBorder(int dir){
+	DXTEST_COUNT(CacheBorderUpdates);
+	int axis = dir / 2;
+	int layer = dir % 2 ? CELLSIZE - 1 : 0;
+	for(int i = 0; i < CELLSIZE; i++) for(int j = 0; j < CELLSIZE; j++){
+		int idx[3];
+		idx[axis] = layer;
+		idx[(axis + 1) % 3] = i;
+		idx[(axis + 2) % 3] = j;
+		updateAdj(idx[0], idx[1], idx[2]);
+	}
+
+	// Columns run along Y, so the layer of a Y face covers all of them, while others cover a row.
+	bool any = false;
+	for(int ix = 0; ix < CELLSIZE; ix++) for(int iz = 0; iz < CELLSIZE; iz++){
+		if((axis == 0 && ix != layer) || (axis == 2 && iz != layer))
+			continue;
+		any |= updateColumnCache(ix, iz);
+	}
+	if(!any)
+		return;
+
+	for(int i = 0; i < CELLSIZE; i++) for(int j = 0; j < CELLSIZE; j++){
+		int idx[3];
+		idx[axis] = layer;
+		idx[(axis + 1) % 3] = i;
+		idx[(axis + 2) % 3] = j;
+		updateCellFaces(idx[0], idx[1], idx[2]);
+	}
+}
+
+/// <summary>Recomputes adjacency, face masks and the scanline column of a Cell.</summary>
+void CellVolume::updateCellCache(int ix, int iy, int iz){
+	updateAdj(ix, iy, iz);
+	if(updateColumnCache(ix, iz))
+		updateCellFaces(ix, iy, iz);
+}
+
+/// <summary>Recomputes column masks and scanlines of a column from adjacency of its Cells.</summary>
+/// <returns>Whether the cache is allocated afterwards.</returns>
+bool CellVolume::updateColumnCache(int ix, int iz){
+	unsigned short solid, tran;
+	if(!buildColumnMasks(ix, iz, solid, tran) && !scanLineCache)
+		return false;
+	if(!scanLineCache){
+		scanLineCache = new ScanLineCache;
+		memset(scanLineCache, 0, sizeof *scanLineCache);
+		updateFaces();
+	}
+	scanLineCache->solidColumns[ix][iz] = solid;
+	scanLineCache->tranColumns[ix][iz] = tran;
+	setScanLine(scanLineCache->solid[ix][iz], solid);
+	setScanLine(scanLineCache->tran[ix][iz], tran);
+	return true;
+}
+
+/// <remarks>Air Cells are never drawn, so their adjacency is not maintained and kept zero,
+/// which also keeps sky CellVolumes uniform.
+/// Neighbors are looked up in occupancy bitsets, which is cheaper than fetching Cells.</remarks>
 void CellVolume::updateAdj(int ix, int iy, int iz){
-	v[ix][iy][iz].adjacents =
-		(!cell(ix - 1, iy, iz).isTranslucent() ? 1 : 0) +
-        (!cell(ix + 1, iy, iz).isTranslucent() ? 1 : 0) +
-        (!cell(ix, iy - 1, iz).isTranslucent() ? 1 : 0) +
-        (!cell(ix, iy + 1, iz).isTranslucent() ? 1 : 0) +
-        (!cell(ix, iy, iz - 1).isTranslucent() ? 1 : 0) +
-        (!cell(ix, iy, iz + 1).isTranslucent() ? 1 : 0);
-	v[ix][iy][iz].adjacentWater =
-		(cell(ix - 1, iy, iz).getType() == Cell::Water ? 1 : 0) +
-        (cell(ix + 1, iy, iz).getType() == Cell::Water ? 1 : 0) +
-        (cell(ix, iy - 1, iz).getType() == Cell::Water ? 1 : 0) +
-        (cell(ix, iy + 1, iz).getType() == Cell::Water ? 1 : 0) +
-        (cell(ix, iy, iz - 1).getType() == Cell::Water ? 1 : 0) +
-        (cell(ix, iy, iz + 1).getType() == Cell::Water ? 1 : 0);
+	Cell c = v.get(ix, iy, iz);
+	if(c.type == Cell::Air){
+		if(c.adjacents || c.adjacentWater)
+			v.set(ix, iy, iz, Cell(c.type));
+		return;
+	}
+	int adjacents = 0, adjacentWater = 0;
+	for(int d = 0; d < 6; d++){
+		int jx = ix + (d / 2 == 0 ? d % 2 * 2 - 1 : 0);
+		int jy = iy + (d / 2 == 1 ? d % 2 * 2 - 1 : 0);
+		int jz = iz + (d / 2 == 2 ? d % 2 * 2 - 1 : 0);
+		const CellVolume &cv = occupancyAt(jx, jy, jz);
+		adjacents += cv.opaque.get(jx, jy, jz);
+		adjacentWater += cv.water.get(jx, jy, jz);
+	}
+	c.adjacents = char(adjacents);
+	c.adjacentWater = char(adjacentWater);
+	v.set(ix, iy, iz, c);
 }
 
-void CellVolume::updateCache()
-{
+/// <summary>Updates adjacency of all Cells a Cell at a time.</summary>
+/// <remarks>Reference implementation of updateAdjBits(), kept for benchmarking.</remarks>
+void CellVolume::updateAdjRecursive(){
 	for (int ix = 0; ix < CELLSIZE; ix++) for (int iy = 0; iy < CELLSIZE; iy++) for (int iz = 0; iz < CELLSIZE; iz++)
 		updateAdj(ix, iy, iz);
-    
-	// Build up scanline map
-	for (int ix = 0; ix < CELLSIZE; ix++) for (int iz = 0; iz < CELLSIZE; iz++)
-	{
-		// Find start and end points for this scan line
-		bool begun = false;
-		bool transBegun = false;
-		for (int iy = 0; iy < CELLSIZE; iy++)
-		{
-			Cell &c = v[ix][iy][iz];
-			if (c.type != Cell::Air && (c.adjacents != 0 && c.adjacents != 6))
-			{
-				if (!begun)
-				{
-					begun = true;
-					_scanLines[ix][iz][0] = iy;
-				}
-				_scanLines[ix][iz][1] = iy + 1;
-			}
+}
 
-			if(c.type == Cell::Water && c.adjacents != 6 && c.adjacentWater != 6 && c.adjacents + c.adjacentWater != 6){
-				if(!transBegun){
-					transBegun = true;
-					tranScanLines[ix][iz][0] = iy;
-				}
-				tranScanLines[ix][iz][1] = iy + 1;
+/// <summary>Copies Cell types of this CellVolume and a single layer around it into an apron buffer.</summary>
+/// <remarks>
+/// Cells outside this CellVolume get the same values operator() would return, including clamping
+/// to our own border Cells where neighbors are not loaded.  Faces are copied through the neighbor
+/// links directly; only edges and corners go through operator().
+/// </remarks>
+void CellVolume::snapshot(CellApron &apron)const{
+	static const int S = CellApron::Size;
+	if(v.isUniform())
+		memset(apron.types, v.get(0, 0, 0).getType(), sizeof apron.types);
+	else for(int ix = 0; ix < CELLSIZE; ix++) for(int iy = 0; iy < CELLSIZE; iy++) for(int iz = 0; iz < CELLSIZE; iz++)
+		apron.types[ix + 1][iy + 1][iz + 1] = (unsigned char)v.get(ix, iy, iz).getType();
+
+	for(int i = 0; i < CELLSIZE; i++) for(int j = 0; j < CELLSIZE; j++){
+		apron.types[0][i + 1][j + 1] = neighbors[0] ? (unsigned char)neighbors[0]->v.get(CELLSIZE - 1, i, j).getType() : apron.types[1][i + 1][j + 1];
+		apron.types[S - 1][i + 1][j + 1] = neighbors[1] ? (unsigned char)neighbors[1]->v.get(0, i, j).getType() : apron.types[S - 2][i + 1][j + 1];
+		apron.types[i + 1][0][j + 1] = neighbors[2] ? (unsigned char)neighbors[2]->v.get(i, CELLSIZE - 1, j).getType() : apron.types[i + 1][1][j + 1];
+		apron.types[i + 1][S - 1][j + 1] = neighbors[3] ? (unsigned char)neighbors[3]->v.get(i, 0, j).getType() : apron.types[i + 1][S - 2][j + 1];
+		apron.types[i + 1][j + 1][0] = neighbors[4] ? (unsigned char)neighbors[4]->v.get(i, j, CELLSIZE - 1).getType() : apron.types[i + 1][j + 1][1];
+		apron.types[i + 1][j + 1][S - 1] = neighbors[5] ? (unsigned char)neighbors[5]->v.get(i, j, 0).getType() : apron.types[i + 1][j + 1][S - 2];
+	}
+
+	// Edges and corners, where at least two indices are out of range.
+	for(int ix = -1; ix <= CELLSIZE; ix++) for(int iy = -1; iy <= CELLSIZE; iy++) for(int iz = -1; iz <= CELLSIZE; iz++){
+		int outs = (ix < 0 || CELLSIZE <= ix) + (iy < 0 || CELLSIZE <= iy) + (iz < 0 || CELLSIZE <= iz);
+		if(2 <= outs)
+			apron.types[ix + 1][iy + 1][iz + 1] = (unsigned char)(*this)(ix, iy, iz).getType();
+	}
+}
+
+/// <summary>Updates adjacency of all Cells from a snapshot.</summary>
+/// <remarks>Does the same thing as updateAdj() for every Cell, but reads neighbors from the
+/// apron buffer with fixed strides.  Superseded by updateAdjBits(), kept for benchmarking.</remarks>
+void CellVolume::updateAdjApron(const CellApron &apron){
+	// Classification of Cell types: bit 0 is opaque, bit 1 is water.
+	// Half-height Cells are translucent.
+	static const unsigned char typeFlags[16] = {
+		0, 1, 1, 1, 1, 2, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+	};
+	for(int ix = 1; ix <= CELLSIZE; ix++) for(int iy = 1; iy <= CELLSIZE; iy++) for(int iz = 1; iz <= CELLSIZE; iz++){
+		unsigned char t = apron.types[ix][iy][iz];
+		if(t == Cell::Air){
+			const Cell &c = v.get(ix - 1, iy - 1, iz - 1);
+			if(c.adjacents || c.adjacentWater)
+				v.set(ix - 1, iy - 1, iz - 1, Cell(c.type));
+			continue;
+		}
+		int flags[6] = {
+			typeFlags[apron.types[ix - 1][iy][iz] & 15],
+			typeFlags[apron.types[ix + 1][iy][iz] & 15],
+			typeFlags[apron.types[ix][iy - 1][iz] & 15],
+			typeFlags[apron.types[ix][iy + 1][iz] & 15],
+			typeFlags[apron.types[ix][iy][iz - 1] & 15],
+			typeFlags[apron.types[ix][iy][iz + 1] & 15],
+		};
+		Cell c = v.get(ix - 1, iy - 1, iz - 1);
+		c.adjacents = char((flags[0] & 1) + (flags[1] & 1) + (flags[2] & 1) + (flags[3] & 1) + (flags[4] & 1) + (flags[5] & 1));
+		c.adjacentWater = char((flags[0] >> 1) + (flags[1] >> 1) + (flags[2] >> 1) + (flags[3] >> 1) + (flags[4] >> 1) + (flags[5] >> 1));
+		v.set(ix - 1, iy - 1, iz - 1, c);
+	}
+}
+
+void CellVolume::updateCache()
+{
+	DXTEST_COUNT(CacheRebuilds);
+	if(v.isUniform()){
+		// A uniform CellVolume is trivially resolved if all its border Cells have the same
+		// adjacency as interior ones, so only the outer shell needs examining.
+		// A shell Cell that differs expands the storage and we take the regular path.
+		Cell c = v.get(0, 0, 0);
+		if(c.type != Cell::Air){
+			c.adjacents = c.isTranslucent() ? 0 : 6;
+			c.adjacentWater = c.type == Cell::Water ? 6 : 0;
+			v.fill(c);
+			for(int ix = 0; ix < CELLSIZE; ix++) for(int iy = 0; iy < CELLSIZE; iy++){
+				bool border = ix == 0 || ix == CELLSIZE - 1 || iy == 0 || iy == CELLSIZE - 1;
+				for(int iz = 0; iz < CELLSIZE; iz += border || iz == CELLSIZE - 1 ? 1 : CELLSIZE - 1)
+					updateAdj(ix, iy, iz);
 			}
 		}
+		if(v.isUniform()){
+			delete scanLineCache;
+			scanLineCache = NULL;
+			return;
+		}
+	}
+
+	if(!scanLineCache)
+		scanLineCache = new ScanLineCache;
+
+	// Build up scanline map
+	CellBitset solidFaces, waterFaces;
+	updateAdjBits(solidFaces, waterFaces);
+	bool any = buildScanLines(solidFaces, waterFaces);
+	if(any)
+		updateFaces();
+
+	if(!any){
+		delete scanLineCache;
+		scanLineCache = NULL;
 	}
+
+	// Adjacency updates leave stale palette entries behind.
+	v.compact();
 }
 
+/// <remarks>Evicted CellVolumes with modifications are copied from the swap file,
+/// so that they are not lost from the save file.</remarks>
 void World::serialize(std::ostream &o){
-	int count = volume.size();
+	std::vector<std::streamoff> swapped;
+	for(ChunkMap<std::streamoff>::iterator it = swapIndex.begin(); it != swapIndex.end(); it++)
+		if(volume.find(it->first) == volume.end())
+			swapped.push_back(it->second);
+	if(!swapped.empty() && !openSwapFile())
+		swapped.clear();
+
+	int gen = generator;
+	o.write((char*)&gen, sizeof gen);
+	int count = volume.size() + swapped.size();
 	o.write((char*)&count, sizeof count);
 	for(VolumeMap::iterator it = volume.begin(); it != volume.end(); it++)
 		it->second.serialize(o);
+	for(std::vector<std::streamoff>::iterator it = swapped.begin(); it != swapped.end(); it++){
+		char buf[CellVolume::serializedSize];
+		swapFile.seekg(*it);
+		swapFile.read(buf, sizeof buf);
+		o.write(buf, sizeof buf);
+	}
 }
 
-void World::unserialize(std::istream &is){
+/// <param name="fileVersion">Game::saveFileVersion of the file, which tells if the generator is saved.</param>
+void World::unserialize(std::istream &is, int fileVersion){
 	try
 	{
+		int gen = LatticeGenerator;
+		if(2 <= fileVersion)
+			is.read((char*)&gen, sizeof gen);
+		if(gen < LatticeGenerator || LatestGenerator < gen)
+			throw std::runtime_error("Unknown terrain generator");
+		generator = Generator(gen);
+		for(VolumeMap::iterator it = volume.begin(); it != volume.end(); it++)
+			recordChange(it->first);
 		volume.clear();
+		surfaces.clear();
+		swapIndex.clear();
+		dirtyVolumes.clear();
 		int count;
 		is.read((char*)&count, sizeof count);
 		for (int i = 0; i < count; i++)
-		{
-			CellVolume cv(this);
-			cv.unserialize(is);
-			volume.insert(std::pair<Vec3i, CellVolume>(cv.getIndex(), cv));
-		}
-		for(VolumeMap::iterator it = volume.begin(); it != volume.end(); it++)
+			unserializeVolume(is);
+		for(VolumeMap::iterator it = volume.begin(); it != volume.end(); it++){
+			addSurface(it->second);
 			it->second.updateCache();
+		}
 	}
 	catch(std::exception &e)
 	{
@@ -7,9 +7,15 @@
 #include <cpplib/vec3.h>
 #include <cpplib/vec4.h>
 #include <cpplib/quat.h>
-#include <map>
 #include <fstream>
+#include <vector>
+#include <string>
+#include <string.h>
+#include <limits.h>
 #include "SignModulo.h"
+#include "ChunkMap.h"
+#include "BitOps.h"
+#include "Instrument.h"
 
 namespace dxtest{
 
@@ -17,6 +23,7 @@ const int CELLSIZE = 16;
 
 class Game;
 class World;
+struct DirtyCells;
 
 /// <summary>The atomic unit of the world.</summary>
 class Cell{
@@ -37,7 +44,7 @@ public:
 		NumTypes
 	};
 
-	Cell(Type t = Air) : type(t), adjacents(0), adjacentWater(0){}
+	Cell(Type t = Air) : type(t), value(0), adjacents(0), adjacentWater(0){}
 	Type getType()const{return type;}
 	short getValue()const{return value;}
 	void setValue(short avalue){value = avalue;}
@@ -45,6 +52,10 @@ public:
 	int getAdjacentWaterCells()const{return adjacentWater;}
 	bool isSolid()const{return type != Air && type != Water;}
 	bool isTranslucent()const{return type == Air || type == Water || type & HalfBit;}
+	bool operator==(const Cell &o)const{
+		return type == o.type && value == o.value && adjacents == o.adjacents && adjacentWater == o.adjacentWater;
+	}
+	bool operator!=(const Cell &o)const{return !operator==(o);}
 	void serialize(std::ostream &o);
 	void unserialize(std::istream &i);
 protected:
@@ -56,6 +67,160 @@ protected:
 	friend class CellVolume;
 };
 
+/// <summary>Layout policy that places Cells in x-major order, Z being the fastest varying axis.</summary>
+struct LinearLayout{
+	static const char *name(){return "linear";}
+	static int index(int ix, int iy, int iz){
+		return (ix * CELLSIZE + iy) * CELLSIZE + iz;
+	}
+};
+
+/// <summary>Layout policy that places vertical columns contiguously, Y being the fastest varying axis.</summary>
+/// <remarks>Suits scanline walks, which scan Y inside (X, Z) columns.</remarks>
+struct ColumnLayout{
+	static const char *name(){return "column";}
+	static int index(int ix, int iy, int iz){
+		return (ix * CELLSIZE + iz) * CELLSIZE + iy;
+	}
+};
+
+/// <summary>Layout policy that interleaves bits of indices (Morton or Z-order).</summary>
+/// <remarks>Keeps neighbors along any axis close in memory.  Assumes CELLSIZE of 16.</remarks>
+struct MortonLayout{
+	static const char *name(){return "morton";}
+	static int spread(int v){
+		return (v & 1) | (v & 2) << 2 | (v & 4) << 4 | (v & 8) << 6;
+	}
+	static int index(int ix, int iy, int iz){
+		return spread(ix) << 2 | spread(iy) << 1 | spread(iz);
+	}
+};
+
+/// The layout of Cells in CellStorage, selectable at compile time by defining
+/// DXTEST_CELL_LAYOUT to one of LinearLayout, ColumnLayout and MortonLayout.
+#ifndef DXTEST_CELL_LAYOUT
+#define DXTEST_CELL_LAYOUT LinearLayout
+#endif
+typedef DXTEST_CELL_LAYOUT CellLayout;
+
+/// <summary>Storage of Cells in a CellVolume, optionally paletted.</summary>
+/// <remarks>
+/// Most CellVolumes contain only a handful of distinct Cells, so storing a full Cell per voxel
+/// wastes 32 KB per CellVolume.  In paletted mode, distinct Cell values are stored once in a
+/// palette and each voxel holds an index of 1, 2, 4 or 8 bits.  The index width grows
+/// automatically as new values appear, and the storage falls back to a plain Cell array
+/// when the palette would exceed 256 entries.
+///
+/// Note that the palette includes cached adjacency values in Cells, because get() must
+/// return a reference to a complete Cell.
+///
+/// A storage whose Cells are all the same is uniform: it has zero bits per index and no index
+/// array at all, which is the case for most of sky and bedrock.  New storages start out as
+/// uniform Air and expand on the first set() of a different value.
+///
+/// The order of Cells in memory is defined by CellLayout, hidden behind get() and set().
+/// </remarks>
+class CellStorage{
+public:
+	static const int MaxPaletteSize = 256;
+	static const int NumCells = CELLSIZE * CELLSIZE * CELLSIZE;
+
+	CellStorage(bool paletted = true);
+	CellStorage(const CellStorage &o);
+	~CellStorage();
+	CellStorage &operator=(const CellStorage &o);
+
+	const Cell &get(int ix, int iy, int iz)const;
+	void set(int ix, int iy, int iz, Cell c);
+	void fill(const Cell &c);
+	void compact();
+
+	static void reserve(int bits, size_t count);
+
+	bool isPaletted()const{return !full;}
+	bool isUniform()const{return !full && bits == 0;}
+	int getBits()const{return bits;}
+	int getPaletteSize()const{return int(palette.size());}
+	size_t getMemoryUsage()const;
+
+protected:
+	Cell *full; ///< Plain Cell array, non-NULL only if not paletted.
+	std::vector<Cell> palette;
+	unsigned char *indices;
+	int bits; ///< Bits per index in paletted mode, one of 0 (uniform), 1, 2, 4 and 8.
+	bool paletted; ///< Whether compact() should return to paletted mode.
+
+	static int index(int ix, int iy, int iz){
+		return CellLayout::index(ix, iy, iz);
+	}
+	int getIndex(int i)const{
+		if(bits == 0)
+			return 0;
+		return (indices[i * bits >> 3] >> (i * bits & 7)) & ((1 << bits) - 1);
+	}
+	void setIndex(int i, int p){
+		unsigned char &b = indices[i * bits >> 3];
+		int shift = i * bits & 7;
+		b = (unsigned char)((b & ~(((1 << bits) - 1) << shift)) | (p << shift));
+	}
+	void setBits(int newbits);
+	void toFull();
+	void release();
+
+	/// Buffers are recycled through BlockPools, one per size, since CellVolumes come and go constantly.
+	static BlockPool &indexPool(int bits){
+		switch(bits){
+		case 1: return BlockPool::pool<NumCells / 8>();
+		case 2: return BlockPool::pool<NumCells * 2 / 8>();
+		case 4: return BlockPool::pool<NumCells * 4 / 8>();
+		default: return BlockPool::pool<NumCells>(); // 8 bits
+		}
+	}
+	static BlockPool &fullPool(){return BlockPool::pool<NumCells * sizeof(Cell)>();}
+	static unsigned char *allocIndices(int bits){return static_cast<unsigned char*>(indexPool(bits).allocate());}
+	static Cell *allocFull(){return static_cast<Cell*>(fullPool().allocate());}
+};
+
+/// <summary>Types of Cells in a CellVolume and a layer of its neighbors, in a flat array.</summary>
+/// <remarks>
+/// Filled by CellVolume::snapshot().  Neighborhood kernels can walk this with fixed strides
+/// without bounds checks or neighbor lookups.  Index 0 and Size - 1 along each axis are the apron
+/// taken from neighboring CellVolumes, so a Cell at (ix, iy, iz) is at [ix + 1][iy + 1][iz + 1].
+/// </remarks>
+struct CellApron{
+	static const int Size = CELLSIZE + 2;
+	unsigned char types[Size][Size][Size];
+};
+
+/// <summary>A bit per Cell in a CellVolume, in rows of Cells along Z.</summary>
+/// <remarks>
+/// Bit iz of rows[ix][iy] corresponds to the Cell at (ix, iy, iz).  Neighbors along Z are a
+/// bit shift away and neighbors along X and Y are other rows, so a kernel can examine 16 Cells
+/// with a single word operation, or a whole slice of constant X in a 256-bit register.
+/// </remarks>
+struct CellBitset{
+	typedef unsigned short Row;
+	Row rows[CELLSIZE][CELLSIZE];
+
+	bool get(int ix, int iy, int iz)const{return (rows[ix][iy] >> iz) & 1;}
+	void set(int ix, int iy, int iz, bool b){
+		if(b)
+			rows[ix][iy] |= Row(1 << iz);
+		else
+			rows[ix][iy] &= Row(~(1 << iz));
+	}
+	void fill(bool b){memset(rows, b ? 0xff : 0, sizeof rows);}
+	int count()const{
+		int ret = 0;
+		for(int i = 0; i < CELLSIZE * CELLSIZE; i += 4){
+			unsigned long long w;
+			memcpy(&w, &rows[0][0] + i, sizeof w);
+			ret += popCount(w);
+		}
+		return ret;
+	}
+};
+
 class CellVolume{
 public:
 	static const Cell v0;
@@ -63,30 +228,91 @@ public:
 protected:
 	World *world;
 	Vec3i index;
-	Cell v[CELLSIZE][CELLSIZE][CELLSIZE];
+	CellStorage v;
+
+	/// <summary>Links to adjacent CellVolumes in order of -X, +X, -Y, +Y, -Z and +Z, NULL if not loaded.</summary>
+	/// <remarks>Maintained by World when CellVolumes are added to or removed from World::volume.
+	/// They belong to the position in the map.</remarks>
+	CellVolume *neighbors[6];
+
+public:
+	typedef int ScanLinesType[CELLSIZE][CELLSIZE][2];
 
-	/// <summary>
-	/// Indices are in order of [X, Z, beginning and end]
-	/// </summary>
-	int _scanLines[CELLSIZE][CELLSIZE][2];
+	/// Bit Y of an element is set if the Cell at Y in the column needs drawing.
+	typedef unsigned short ColumnMasksType[CELLSIZE][CELLSIZE];
+
+protected:
+	/// <summary>Scanline tables and face masks, allocated only if any Cell in this CellVolume needs drawing.</summary>
+	struct ScanLineCache{
+		/// <summary>
+		/// Indices are in order of [X, Z, beginning and end]
+		/// </summary>
+		ScanLinesType solid;
+
+		/// Scanlines for transparent cells
+		ScanLinesType tran;
+
+		/// <summary>Cells that need drawing in order of [X, Z], which scanlines are the bounds of.</summary>
+		/// <remarks>Unlike scanlines, gaps between Cells that need drawing, such as caves
+		/// under overhangs, are not visited when walking the set bits.</remarks>
+		ColumnMasksType solidColumns;
+
+		/// Column masks for transparent cells
+		ColumnMasksType tranColumns;
+
+		/// <summary>Faces of non-Air Cells not covered by opaque Cells, in order of [X, Y, Z].</summary>
+		/// <remarks>Bits 0 to 5 correspond to faces toward -X, +X, -Y, +Y, -Z and +Z.</remarks>
+		unsigned char solidFaces[CELLSIZE][CELLSIZE][CELLSIZE];
+
+		/// Faces of non-Air Cells that face Air, which are drawn for water Cells, in the same order as solidFaces.
+		unsigned char waterFaces[CELLSIZE][CELLSIZE][CELLSIZE];
+
+		static void *operator new(size_t){return BlockPool::pool<sizeof(ScanLineCache)>().allocate();}
+		static void operator delete(void *p){BlockPool::pool<sizeof(ScanLineCache)>().deallocate(p);}
+	};
+	ScanLineCache *scanLineCache;
 
-	/// Scanlines for transparent cells
-	int tranScanLines[CELLSIZE][CELLSIZE][2];
+	/// Returned by getScanLines() and getTranScanLines() if scanLineCache is not allocated.
+	static const ScanLinesType emptyScanLines;
+
+	/// Returned by getColumnMasks() and getTranColumnMasks() if scanLineCache is not allocated.
+	static const ColumnMasksType emptyColumnMasks;
 
 	int _solidcount;
+
+	/// <summary>Histogram of Cell types in this CellVolume, kept in sync with v.</summary>
+	/// <remarks>World::bricks is the sum of these over resident CellVolumes.</remarks>
 	int bricks[Cell::NumTypes];
 
+	/// Bit Y is set if any solid Cell is at Y, which bounds solid Cells vertically.
+	unsigned short solidLayers;
+
+	/// <summary>Occupancy bitsets of Cell types, kept in sync with v.</summary>
+	/// <remarks>Adjacency is computed from these, including those of neighbors, instead of Cells.</remarks>
+	CellBitset opaque; ///< Cells that are not translucent, which count in adjacents.
+	CellBitset solid; ///< Cells that are Cell::isSolid().
+	CellBitset water; ///< Water Cells, which count in adjacentWater.
+
+	bool modified; ///< Whether Cells have changed since generated or read from the swap file.
+	unsigned lastUsed; ///< The World::think() count when this CellVolume was last in view, for LRU eviction.
+	unsigned long long version; ///< World::getEpoch() when Cells last changed, including when generated or loaded.
+
 	void updateAdj(int ix, int iy, int iz);
+	bool buildColumnMasks(int ix, int iz, unsigned short &solid, unsigned short &tran)const;
+	static void setScanLine(int (&line)[2], unsigned mask);
+	bool buildScanLines(const CellBitset &solidFaces, const CellBitset &waterFaces);
+	void updateFaces();
+	void updateCellFaces(int ix, int iy, int iz);
+	void setOccupancy(int ix, int iy, int iz, Cell::Type type);
+	void addBricks(Cell::Type type, int count);
+	const CellVolume &occupancyAt(int &ix, int &iy, int &iz)const;
+	void updateCellCache(int ix, int iy, int iz);
+	bool updateColumnCache(int ix, int iz);
 public:
-	CellVolume(World *world = NULL, const Vec3i &ind = Vec3i(0,0,0)) : world(world), index(ind), _solidcount(0){
-		for(int ix = 0; ix < CELLSIZE; ix++) for(int iy = 0; iy < CELLSIZE; iy++) for(int iz = 0; iz < 2; iz++){
-			_scanLines[ix][iy][iz] = 0;
-			tranScanLines[ix][iy][iz] = 0;
-		}
-		for(int i = 0; i < Cell::NumTypes; i++)
-			bricks[i] = 0;
-	}
+	CellVolume(World *world = NULL, const Vec3i &ind = Vec3i(0,0,0));
+	~CellVolume();
 	const Vec3i &getIndex()const{return index;}
+	CellVolume *getNeighbor(int dir)const{return neighbors[dir];}
 	const Cell &operator()(int ix, int iy, int iz)const;
 	const Cell &cell(int ix, int iy, int iz)const{
 		return operator()(ix, iy, iz);
@@ -96,27 +322,89 @@ public:
 			0 <= ipos[0] && ipos[0] < CELLSIZE &&
 			0 <= ipos[1] && ipos[1] < CELLSIZE &&
 			0 <= ipos[2] && ipos[2] < CELLSIZE &&
-			v[ipos[0]][ipos[1]][ipos[2]].getType() != Cell::Air;
+			v.get(ipos[0], ipos[1], ipos[2]).getType() != Cell::Air;
 	}
-	bool setCell(int ix, int iy, int iz, const Cell &newCell);
 	void initialize(const Vec3i &index);
 	void updateCache();
-	typedef int ScanLinesType[CELLSIZE][CELLSIZE][2];
+	void updateCacheCells(const DirtyCells &dirty);
+	void updateCacheBorder(int dir);
+	void snapshot(CellApron &apron)const;
+	void updateAdjRecursive();
+	void updateAdjApron(const CellApron &apron);
+	void updateAdjBits(CellBitset &solidFaces, CellBitset &waterFaces);
+	void updateOccupancy();
+	const CellBitset &getOpaqueBits()const{return opaque;}
+	const CellBitset &getSolidBits()const{return solid;}
+	const CellBitset &getWaterBits()const{return water;}
 	const ScanLinesType &getScanLines()const{
-		return _scanLines;
+		return scanLineCache ? scanLineCache->solid : emptyScanLines;
 	}
 	const ScanLinesType &getTranScanLines()const{
-		return tranScanLines;
+		return scanLineCache ? scanLineCache->tran : emptyScanLines;
 	}
+	/// <summary>Returns masks of Cells that need drawing in each column, a finer version of getScanLines().</summary>
+	const ColumnMasksType &getColumnMasks()const{
+		return scanLineCache ? scanLineCache->solidColumns : emptyColumnMasks;
+	}
+	const ColumnMasksType &getTranColumnMasks()const{
+		return scanLineCache ? scanLineCache->tranColumns : emptyColumnMasks;
+	}
+	/// <summary>Returns mask of faces of a non-Air Cell not covered by opaque neighbors.</summary>
+	/// <remarks>Bits 0 to 5 correspond to -X, +X, -Y, +Y, -Z and +Z.  Only valid within scanlines.</remarks>
+	int getSolidFaces(int ix, int iy, int iz)const{
+		return scanLineCache ? scanLineCache->solidFaces[ix][iy][iz] : 0;
+	}
+	/// <summary>Returns mask of faces of a non-Air Cell that face Air, in the same order as getSolidFaces().</summary>
+	/// <remarks>Only valid within transparent scanlines.</remarks>
+	int getWaterFaces(int ix, int iy, int iz)const{
+		return scanLineCache ? scanLineCache->waterFaces[ix][iy][iz] : 0;
+	}
+	/// Whether all Cells in this CellVolume are the same, in which case nothing needs drawing.
+	bool isUniform()const{return v.isUniform();}
 	int getSolidCount()const{return _solidcount;}
 	int getBricks(int i)const{return bricks[i];}
+	/// Bit Y of the returned value is set if any solid Cell is at Y.
+	unsigned getSolidLayers()const{return solidLayers;}
+	/// Returns Y index of the lowest solid Cell, or CELLSIZE if there is none.
+	int getMinSolidY()const{return solidLayers ? bitScanForward(solidLayers) : CELLSIZE;}
+	/// Returns Y index of the highest solid Cell, or -1 if there is none.
+	int getMaxSolidY()const{return solidLayers ? bitScanReverse(solidLayers) : -1;}
+	bool hasWater()const{return 0 < bricks[Cell::Water];}
+	bool isAllAir()const{return bricks[Cell::Air] == CellStorage::NumCells;}
+	/// Whether all Cells are opaque, in which case no Cell can be seen or entered from outside.
+	bool isAllOpaque()const{
+		return bricks[Cell::Grass] + bricks[Cell::Dirt] + bricks[Cell::Gravel] + bricks[Cell::Rock] == CellStorage::NumCells;
+	}
+	const CellStorage &getStorage()const{return v;}
+	size_t getMemoryUsage()const;
+	bool isModified()const{return modified;}
+	unsigned getLastUsed()const{return lastUsed;}
+	/// <summary>Returns the content version, which increases whenever Cells change and never goes back,
+	/// even if the CellVolume is evicted and reloaded.</summary>
+	unsigned long long getVersion()const{return version;}
+
+	/// Size in bytes of a record written by serialize().
+	static const int serializedSize = sizeof(Vec3i) + sizeof(int) + CellStorage::NumCells;
+	static void reserveScanLines(size_t count);
 
 	void serialize(std::ostream &o);
 	void unserialize(std::istream &i);
 
-	static int cellInvokes;
-	static int cellForeignInvokes;
-	static int cellForeignExists;
+
+protected:
+	void unserializeCells(std::istream &i);
+
+private:
+	/// Sets a Cell without updating caches, the surface heightmap or the change journal, which
+	/// World::setCell() and World::applyEdits() take care of; use them instead.
+	bool setCell(int ix, int iy, int iz, const Cell &newCell);
+
+	/// CellVolumes are constructed in place in World::volume and never copied, since
+	/// their position in the map is their identity and copying the payload is wasteful.
+	CellVolume(const CellVolume &);
+	CellVolume &operator=(const CellVolume &);
+
+	friend class World;
 };
 
 inline bool operator<(const Vec3i &a, const Vec3i &b){
@@ -134,18 +422,166 @@ inline bool operator<(const Vec3i &a, const Vec3i &b){
 		return false;
 }
 
+/// <summary>Top-most non-Air Cells in a column of CellVolumes that share X and Z indices.</summary>
+/// <remarks>Only resident CellVolumes are taken into account.  Maintained by World.</remarks>
+struct SurfaceColumn{
+	static const int NoSurface = INT_MIN;
+
+	/// World Y index of the top-most non-Air Cell in order of [X, Z], or NoSurface if there is none.
+	int height[CELLSIZE][CELLSIZE];
+
+	/// Cell::Type of the top-most non-Air Cell, Air if there is none.
+	unsigned char type[CELLSIZE][CELLSIZE];
+
+	/// Y indices of resident CellVolumes in this column, in descending order.
+	std::vector<int> volumes;
+
+	SurfaceColumn(){
+		for(int ix = 0; ix < CELLSIZE; ix++) for(int iz = 0; iz < CELLSIZE; iz++){
+			height[ix][iz] = NoSurface;
+			type[ix][iz] = Cell::Air;
+		}
+	}
+};
+
+/// <summary>Cells of a CellVolume whose cache is stale, recorded by World::setCell() until World::updateDirtyVolumes().</summary>
+/// <remarks>Once too many Cells are recorded, rebuilding the whole CellVolume is cheaper than
+/// updating each of them, so we just remember that.</remarks>
+struct DirtyCells{
+	static const int MaxCells = 64;
+
+	/// Number of recorded Cells, or MaxCells + 1 if the whole CellVolume needs rebuilding.
+	int count;
+
+	/// Recorded Cell indices, packed in 4 bits per axis in order of X, Y, Z from the most significant.
+	unsigned short cells[MaxCells];
+
+	/// Faces in bits of -X, +X, -Y, +Y, -Z and +Z whose layer of Cells is stale because
+	/// the neighbor across the face has changed.
+	int borders;
+
+	DirtyCells() : count(0), borders(0){}
+	bool isFull()const{return MaxCells < count;}
+	void add(int ix, int iy, int iz);
+	void fill(){count = MaxCells + 1;}
+};
+
+/// <summary>A Cell to be set at world indices by World::applyEdits().</summary>
+struct CellEdit{
+	Vec3i pos;
+	Cell cell;
+	CellEdit(const Vec3i &pos, const Cell &cell) : pos(pos), cell(cell){}
+};
+
+/// <summary>Types of Cells in a box, copied by World::copyRegion() to be pasted by World::pasteRegion().</summary>
+struct CellRegion{
+	Vec3i size;
+
+	/// Types in order of X, Y, Z from the outermost.
+	std::vector<unsigned char> types;
+
+	Cell::Type get(int ix, int iy, int iz)const{
+		return Cell::Type(types[(ix * size[1] + iy) * size[2] + iz]);
+	}
+};
+
+/// <summary>Bounded cache of height fields of columns of CellVolumes, keyed by their X and Z indices.</summary>
+/// <remarks>
+/// The height field of a CellVolume depends only on its X and Z indices, so every CellVolume in a
+/// vertical stack would otherwise evaluate the same 2D noise.  When the cache is full, the least
+/// recently used field is replaced.
+///
+/// get() may be called by threads generating CellVolumes concurrently.  A miss takes longer than
+/// scanning a thousand keys, so entries live in flat arrays allocated once by the constructor
+/// rather than in a ChunkMap, whose BlockPool is not thread-safe.
+/// </remarks>
+class HeightCache{
+public:
+	typedef float Field[CELLSIZE][CELLSIZE];
+
+	/// Default number of columns, enough for the view distance several times over, at 1 KB each.
+	static const int DefaultCapacity = 1024;
+
+	HeightCache(int capacity = DefaultCapacity);
+	~HeightCache();
+
+	void get(int cx, int cz, Field &field);
+	void clear();
+	int getCapacity()const{return capacity;}
+	static void generate(int cx, int cz, Field &field);
+
+protected:
+	struct Entry{
+		Field field;
+	};
+	struct Mutex;
+
+	Mutex *mutex;
+	int capacity;
+	int count; ///< Number of entries in use, at the beginning of the arrays.
+	unsigned clock; ///< Incremented on every access to stamp entries for LRU replacement.
+	std::vector<unsigned long long> keys; ///< Packed X and Z indices of entries, scanned on lookup.
+	std::vector<unsigned> lastUsed;
+	std::vector<Entry> entries;
+
+	int find(unsigned long long key)const;
+
+private:
+	HeightCache(const HeightCache &);
+	HeightCache &operator=(const HeightCache &);
+};
+
 class Game;
 
 class World{
 public:
-	typedef std::map<Vec3i, CellVolume, bool(*)(const Vec3i &, const Vec3i &)> VolumeMap;
+	typedef ChunkMap<CellVolume> VolumeMap;
 	VolumeMap volume;
 
+	typedef ChunkMap<SurfaceColumn> SurfaceMap;
+
+	/// Heightmap of the surface, keyed by CellVolume indices with Y component of 0.
+	SurfaceMap surfaces;
+
 	Game &game;
 
+	/// Totals of Cell types in resident CellVolumes, maintained by CellVolumes as their histograms change.
 	int bricks[Cell::NumTypes];
 
+	/// Whether newly created CellVolumes store their Cells in paletted form.
+	bool palettedStorage;
+
+	/// Versions of terrain generation.  A World is saved with its version and keeps generating
+	/// with it after loading, so that new CellVolumes match those generated before saving.
+	enum Generator{
+		LatticeGenerator, ///< Material noise by perlin_noise_3D(), the only one before save file version 2.
+		HashedGenerator, ///< Material noise by the vectorized perlin_noise_3D_hashed().
+		LatestGenerator = HashedGenerator
+	};
+
+	/// Version of terrain generation used by CellVolume::initialize(), LatestGenerator for a new World.
+	Generator generator;
+
+	/// Memory budget of resident CellVolumes in bytes, 0 for unlimited.
+	size_t memoryBudget;
+
+	/// Maximum number of resident CellVolumes, 0 for unlimited.
+	int volumeBudget;
+
+	/// The file that modified CellVolumes are written to when evicted.
+	std::string swapFileName;
+
+	/// Height fields of columns shared by the CellVolumes stacked in them.
+	HeightCache heightCache;
+
 	void initialize();
+	void reserve(int chunks);
+	CellVolume &emplaceVolume(const Vec3i &ci);
+	bool eraseVolume(const Vec3i &ci);
+	int getResidentVolumes()const{return int(volume.size());}
+	int getEvictedVolumes()const{return evictedVolumes;}
+	int getReloadedVolumes()const{return reloadedVolumes;}
+	CellVolume *unserializeVolume(std::istream &is);
 	static Vec3i real2ind(const Vec3d &pos);
 	static Vec3d ind2real(const Vec3i &ipos);
 
@@ -164,14 +600,53 @@ public:
 		return cell(pos[0], pos[1], pos[2]);
 	}
 
+	/// <summary>Sets a Cell at given world indices if its CellVolume is resident.</summary>
+	/// <remarks>Caches are not updated immediately; the Cell and its neighbors are marked dirty and
+	/// rebuilt by the next updateDirtyVolumes(), so editing many Cells in a frame rebuilds each CellVolume once.</remarks>
 	bool setCell(int ix, int iy, int iz, const Cell &newCell){
 		Vec3i ci = Vec3i(SignDiv(ix, CELLSIZE), SignDiv(iy, CELLSIZE), SignDiv(iz, CELLSIZE));
 		VolumeMap::iterator it = volume.find(ci);
-		if(it != volume.end())
-			return it->second.setCell(SignModulo(ix, CELLSIZE), SignModulo(iy, CELLSIZE), SignModulo(iz, CELLSIZE), newCell);
+		if(it != volume.end() && it->second.setCell(SignModulo(ix, CELLSIZE), SignModulo(iy, CELLSIZE), SignModulo(iz, CELLSIZE), newCell)){
+			recordChange(it->second);
+			markDirtyCell(ix, iy, iz);
+			updateSurface(ix, iy, iz, newCell.getType());
+			return true;
+		}
 		return false;
 	}
 
+	void markDirtyCell(int ix, int iy, int iz);
+	void markDirtyVolume(const Vec3i &ci);
+	void markDirtyBorder(const Vec3i &ci, int dir);
+	void updateDirtyVolumes();
+	int getDirtyVolumes()const{return int(dirtyVolumes.size());}
+
+	/// <summary>Returns the current epoch of the change journal.</summary>
+	/// <remarks>Remember this after examining CellVolumes, and pass it to getChangedVolumes() later
+	/// to find out which of them need examining again.</remarks>
+	unsigned long long getEpoch()const{return changeEpoch;}
+	void getChangedVolumes(unsigned long long epoch, std::vector<Vec3i> &changed)const;
+
+	int applyEdits(const std::vector<CellEdit> &edits);
+	int fillBox(const Vec3i &lo, const Vec3i &hi, const Cell &cell);
+	int carveSphere(const Vec3i &center, int radius, const Cell &cell = Cell(Cell::Air));
+	int drawLine(const Vec3i &from, const Vec3i &to, const Cell &cell);
+	void copyRegion(const Vec3i &lo, const Vec3i &hi, CellRegion &region)const;
+	int pasteRegion(const CellRegion &region, const Vec3i &pos, bool skipAir = false);
+
+	/// <summary>Returns world Y index of the top-most non-Air Cell at given X and Z in resident CellVolumes.</summary>
+	/// <returns>SurfaceColumn::NoSurface if there is no such Cell.</returns>
+	int surfaceHeight(int ix, int iz)const{
+		SurfaceMap::const_iterator it = surfaces.find(Vec3i(SignDiv(ix, CELLSIZE), 0, SignDiv(iz, CELLSIZE)));
+		return it != surfaces.end() ? it->second.height[SignModulo(ix, CELLSIZE)][SignModulo(iz, CELLSIZE)] : SurfaceColumn::NoSurface;
+	}
+
+	/// <summary>Returns type of the Cell at surfaceHeight(), or Air if there is none.</summary>
+	Cell::Type surfaceType(int ix, int iz)const{
+		SurfaceMap::const_iterator it = surfaces.find(Vec3i(SignDiv(ix, CELLSIZE), 0, SignDiv(iz, CELLSIZE)));
+		return it != surfaces.end() ? Cell::Type(it->second.type[SignModulo(ix, CELLSIZE)][SignModulo(iz, CELLSIZE)]) : Cell::Air;
+	}
+
 	bool isSolid(int ix, int iy, int iz){
 		return isSolid(Vec3i(ix, iy, iz));
 	}
@@ -188,7 +663,46 @@ public:
 	void think(double dt);
 
 	void serialize(std::ostream &o);
-	void unserialize(std::istream &i);
+	void unserialize(std::istream &i, int fileVersion);
+
+protected:
+	/// <summary>Offsets in the swap file of evicted CellVolumes that had been modified.</summary>
+	/// <remarks>Unmodified CellVolumes are just dropped, since they can be generated again.</remarks>
+	ChunkMap<std::streamoff> swapIndex;
+	std::fstream swapFile;
+
+	unsigned thinkCount; ///< Clock of LRU eviction, incremented every think().
+
+	/// Frames between sums of memory usage of resident CellVolumes by evictVolumes().
+	static const unsigned MemoryCheckInterval = 16;
+
+	/// Memory usage of resident CellVolumes at the last sum by evictVolumes(), less evicted ones since.
+	size_t residentMemory;
+	int evictedVolumes; ///< Count of CellVolumes evicted so far
+	int reloadedVolumes; ///< Count of CellVolumes read back from the swap file so far
+
+	/// CellVolumes with stale caches.  Only resident CellVolumes are ever recorded.
+	ChunkMap<DirtyCells> dirtyVolumes;
+
+	/// <summary>The epoch of each CellVolume index when its Cells last changed, appeared or disappeared.</summary>
+	/// <remarks>Entries are kept for evicted CellVolumes too, so the journal grows with the explored area,
+	/// which is tiny compared to the Cells themselves.</remarks>
+	ChunkMap<unsigned long long> changeJournal;
+	unsigned long long changeEpoch; ///< Incremented every time a change is recorded.
+
+	void recordChange(const Vec3i &ci);
+	void recordChange(CellVolume &cv);
+
+	void linkVolume(CellVolume &cv);
+	void unlinkVolume(CellVolume &cv);
+	void evictVolumes();
+	void evictVolume(CellVolume &cv);
+	void addSurface(const CellVolume &cv);
+	void removeSurface(const CellVolume &cv);
+	void updateSurface(int ix, int iy, int iz, Cell::Type type);
+	void scanSurface(SurfaceColumn &column, int cx, int cz, int ix, int iz, int fromy);
+	CellVolume *reloadVolume(const Vec3i &ci);
+	bool openSwapFile();
 };
 
 
@@ -213,15 +727,87 @@ inline void Cell::unserialize(std::istream &i){
 inline void CellVolume::serialize(std::ostream &o){
 	o.write((char*)&index, sizeof index);
 	o.write((char*)&_solidcount, sizeof _solidcount);
-	for(int ix = 0; ix < CELLSIZE; ix++) for(int iy = 0; iy < CELLSIZE; iy++) for(int iz = 0; iz < CELLSIZE; iz++)
-		v[ix][iy][iz].serialize(o);
+	char buf[CellStorage::NumCells];
+	if(v.isUniform())
+		memset(buf, v.get(0, 0, 0).getType(), sizeof buf);
+	else{
+		char *p = buf;
+		for(int ix = 0; ix < CELLSIZE; ix++) for(int iy = 0; iy < CELLSIZE; iy++) for(int iz = 0; iz < CELLSIZE; iz++)
+			*p++ = (char)v.get(ix, iy, iz).getType();
+	}
+	o.write(buf, sizeof buf);
 }
 
+/// <remarks>The stream has the same format as a sequence of Cell::serialize() for each Cell,
+/// but we read it in a chunk to detect uniform CellVolumes cheaply.</remarks>
 inline void CellVolume::unserialize(std::istream &i){
 	i.read((char*)&index, sizeof index);
+	unserializeCells(i);
+}
+
+/// <summary>Reads the rest of a serialized CellVolume after its index.</summary>
+/// <remarks>World reads the index first to construct the CellVolume in place.</remarks>
+inline void CellVolume::unserializeCells(std::istream &i){
 	i.read((char*)&_solidcount, sizeof _solidcount);
-	for(int ix = 0; ix < CELLSIZE; ix++) for(int iy = 0; iy < CELLSIZE; iy++) for(int iz = 0; iz < CELLSIZE; iz++)
-		v[ix][iy][iz].unserialize(i);
+	char buf[CellStorage::NumCells];
+	i.read(buf, sizeof buf);
+	bool uniform = true;
+	for(int j = 1; j < CellStorage::NumCells && uniform; j++)
+		uniform = buf[j] == buf[0];
+	if(uniform)
+		v.fill(Cell((Cell::Type)buf[0]));
+	else{
+		v.fill(Cell());
+		const char *p = buf;
+		for(int ix = 0; ix < CELLSIZE; ix++) for(int iy = 0; iy < CELLSIZE; iy++) for(int iz = 0; iz < CELLSIZE; iz++)
+			v.set(ix, iy, iz, Cell((Cell::Type)*p++));
+	}
+	updateOccupancy();
+}
+
+
+inline const Cell &CellStorage::get(int ix, int iy, int iz)const{
+	if(full)
+		return full[index(ix, iy, iz)];
+	return palette[getIndex(index(ix, iy, iz))];
+}
+
+/// <summary>Assigns a Cell, growing the palette or the index width as necessary.</summary>
+/// <remarks>The Cell is taken by value because it may refer to our own palette entry.</remarks>
+inline void CellStorage::set(int ix, int iy, int iz, Cell c){
+	int i = index(ix, iy, iz);
+	if(full){
+		full[i] = c;
+		return;
+	}
+
+	// Fast path for rewriting the same value, which is common in cache updates.
+	int cur = getIndex(i);
+	if(palette[cur] == c)
+		return;
+
+	// Copy on write of uniform storage when palette is disabled.
+	if(!paletted){
+		toFull();
+		full[i] = c;
+		return;
+	}
+
+	int p;
+	for(p = 0; p < int(palette.size()); p++)
+		if(palette[p] == c)
+			break;
+	if(p == int(palette.size())){
+		if(p == MaxPaletteSize){
+			toFull();
+			full[i] = c;
+			return;
+		}
+		if(p == 1 << bits)
+			setBits(bits ? bits * 2 : 1);
+		palette.push_back(c);
+	}
+	setIndex(i, p);
 }
 
 
@@ -233,56 +819,55 @@ class Player;
 ///
 /// Note that even if two or more indices are out of range, this function will find the correct Cell
 /// by recursively calling itself in turn with each axes.
-/// But what's the difference between this and World::cell(), you may ask. That's the key for the next
-/// step of optimization.
+/// But what's the difference between this and World::cell(), you may ask.  This function follows
+/// the neighbor links instead of looking up World::volume, so a foreign access costs a pointer hop.
+/// An index more than CELLSIZE out of range hops multiple times, so it resolves to a border Cell of
+/// the last loaded CellVolume along the way if the destination is not loaded.
 /// </remarks>
 /// <param name="ix">Index along X axis in Cells. If in range [0, CELLSIZE), this object's member is returned.</param>
 /// <param name="iy">Index along Y axis in Cells. If in range [0, CELLSIZE), this object's member is returned.</param>
 /// <param name="iz">Index along Z axis in Cells. If in range [0, CELLSIZE), this object's member is returned.</param>
 /// <returns>A CellInt object at ix, iy, iz</returns>
 inline const Cell &CellVolume::operator()(int ix, int iy, int iz)const{
-	cellInvokes++;
+	DXTEST_COUNT(CellInvokes);
 	if(ix < 0 || CELLSIZE <= ix){
-		cellForeignInvokes++;
-		Vec3i ci(index[0] + SignDiv(ix, CELLSIZE), index[1], index[2]);
-		World::VolumeMap::iterator it = world->volume.find(ci);
-		if(it != world->volume.end()){
-			cellForeignExists++;
-			const CellVolume &cv = it->second;
-			return cv(SignModulo(ix, CELLSIZE), iy, iz);
+		DXTEST_COUNT(CellForeignInvokes);
+		const CellVolume *cv = neighbors[ix < 0 ? 0 : 1];
+		if(cv){
+			DXTEST_COUNT(CellForeignExists);
+			return (*cv)(ix < 0 ? ix + CELLSIZE : ix - CELLSIZE, iy, iz);
 		}
 		else
 			return (*this)(ix < 0 ? 0 : CELLSIZE - 1, iy, iz);
 	}
 	if(iy < 0 || CELLSIZE <= iy){
-		cellForeignInvokes++;
-		Vec3i ci(index[0], index[1] + SignDiv(iy, CELLSIZE), index[2]);
-		World::VolumeMap::iterator it = world->volume.find(ci);
-		if(it != world->volume.end()){
-			cellForeignExists++;
-			const CellVolume &cv = it->second;
-			return cv(ix, SignModulo(iy, CELLSIZE), iz);
+		DXTEST_COUNT(CellForeignInvokes);
+		const CellVolume *cv = neighbors[iy < 0 ? 2 : 3];
+		if(cv){
+			DXTEST_COUNT(CellForeignExists);
+			return (*cv)(ix, iy < 0 ? iy + CELLSIZE : iy - CELLSIZE, iz);
 		}
 		else
 			return (*this)(ix, iy < 0 ? 0 : CELLSIZE - 1, iz);
 	}
 	if(iz < 0 || CELLSIZE <= iz){
-		cellForeignInvokes++;
-		Vec3i ci(index[0], index[1], index[2] + SignDiv(iz, CELLSIZE));
-		World::VolumeMap::iterator it = world->volume.find(ci);
-		if(it != world->volume.end()){
-			cellForeignExists++;
-			const CellVolume &cv = it->second;
-			return cv(ix, iy, SignModulo(iz, CELLSIZE));
+		DXTEST_COUNT(CellForeignInvokes);
+		const CellVolume *cv = neighbors[iz < 0 ? 4 : 5];
+		if(cv){
+			DXTEST_COUNT(CellForeignExists);
+			return (*cv)(ix, iy, iz < 0 ? iz + CELLSIZE : iz - CELLSIZE);
 		}
 		else
 			return (*this)(ix, iy, iz < 0 ? 0 : CELLSIZE - 1);
 	}
-	return
-		0 <= ix && ix < CELLSIZE &&
-		0 <= iy && iy < CELLSIZE &&
-		0 <= iz && iz < CELLSIZE 
-		? v[ix][iy][iz] : v0;
+	return v.get(ix, iy, iz);
+}
+
+/// <summary>Adds to the count of a Cell type in the histogram and to the totals of World.</summary>
+inline void CellVolume::addBricks(Cell::Type type, int count){
+	bricks[type] += count;
+	if(world)
+		world->bricks[type] += count;
 }
 
 inline bool CellVolume::setCell(int ix, int iy, int iz, const Cell &newCell){
@@ -290,25 +875,15 @@ inline bool CellVolume::setCell(int ix, int iy, int iz, const Cell &newCell){
 		return false;
 	else
 	{
-		// Update solidcount by difference of solidity before and after cell assignment.
-		int before = v[ix][iy][iz].isSolid();
-		int after = newCell.isSolid();
-		_solidcount += after - before;
-
-		v[ix][iy][iz] = newCell;
-		updateCache();
-		if(ix <= 0)
-			world->volume[Vec3i(index[0] - 1, index[1], index[2])].updateCache();
-		else if(CELLSIZE - 1 <= ix)
-			world->volume[Vec3i(index[0] + 1, index[1], index[2])].updateCache();
-		if(iy <= 0)
-			world->volume[Vec3i(index[0], index[1] - 1, index[2])].updateCache();
-		else if (CELLSIZE - 1 <= iy)
-			world->volume[Vec3i(index[0], index[1] + 1, index[2])].updateCache();
-		if(iz <= 0)
-			world->volume[Vec3i(index[0], index[1], index[2] - 1)].updateCache();
-		else if (CELLSIZE - 1 <= iz)
-			world->volume[Vec3i(index[0], index[1], index[2] + 1)].updateCache();
+		// Update solidcount and the histogram by difference before and after cell assignment.
+		Cell::Type before = v.get(ix, iy, iz).getType();
+		_solidcount += int(newCell.isSolid()) - int(Cell(before).isSolid());
+		addBricks(before, -1);
+		addBricks(newCell.getType(), 1);
+
+		v.set(ix, iy, iz, newCell);
+		setOccupancy(ix, iy, iz, newCell.getType());
+		modified = true;
 		return true;
 	}
 }
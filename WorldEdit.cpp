@@ -0,0 +1,180 @@
+#include "World.h"
+#include <algorithm>
+#include <stdlib.h>
+/** \file
+ * \brief Implements bulk edit operations of World.
+ *
+ * World::setCell() marks a Cell and its neighbors dirty per call, which adds up for tools,
+ * explosions and structure placement that change thousands of Cells at once.  The operations
+ * here collect their Cells into a batch that World::applyEdits() writes directly into Cell
+ * storage a CellVolume at a time, then rebuild each affected CellVolume exactly once and only
+ * the border layers of its neighbors.
+ */
+
+namespace dxtest{
+
+namespace{
+
+/// \brief Orders edits by the index of the CellVolume they fall in.
+struct LessVolume{
+	static Vec3i volumeIndex(const Vec3i &pos){
+		return Vec3i(SignDiv(pos[0], CELLSIZE), SignDiv(pos[1], CELLSIZE), SignDiv(pos[2], CELLSIZE));
+	}
+	bool operator()(const CellEdit &a, const CellEdit &b)const{
+		return volumeIndex(a.pos) < volumeIndex(b.pos);
+	}
+};
+
+}
+
+/// <summary>Sets a batch of Cells, rebuilding caches of affected CellVolumes once at the end.</summary>
+/// <remarks>
+/// Edits are grouped by CellVolume, so each is looked up once.  Edits in CellVolumes that
+/// are not resident are ignored, and so are those that do not change the Cell type.
+/// Where an edited Cell lies on a border of its CellVolume, only the layer of Cells of the
+/// neighbor across the border is refreshed instead of the whole neighbor.
+/// If the same Cell is edited more than once, the last edit wins.
+/// </remarks>
+/// <returns>The number of Cells changed.</returns>
+int World::applyEdits(const std::vector<CellEdit> &edits){
+	std::vector<CellEdit> sorted(edits);
+	std::stable_sort(sorted.begin(), sorted.end(), LessVolume());
+
+	int changed = 0;
+	for(std::vector<CellEdit>::size_type i = 0; i < sorted.size();){
+		Vec3i ci = LessVolume::volumeIndex(sorted[i].pos);
+		std::vector<CellEdit>::size_type end = i;
+		while(end < sorted.size() && LessVolume::volumeIndex(sorted[end].pos) == ci)
+			end++;
+
+		VolumeMap::iterator it = volume.find(ci);
+		if(it == volume.end()){
+			i = end;
+			continue;
+		}
+		CellVolume &cv = it->second;
+
+		// Faces of this CellVolume that have edited Cells on them, in the order of neighbors.
+		int borders = 0;
+		int volumeChanged = 0;
+		for(; i < end; i++){
+			const Vec3i &pos = sorted[i].pos;
+			int ix = SignModulo(pos[0], CELLSIZE), iy = SignModulo(pos[1], CELLSIZE), iz = SignModulo(pos[2], CELLSIZE);
+			if(cv(ix, iy, iz).getType() == sorted[i].cell.getType())
+				continue;
+			cv.setCell(ix, iy, iz, sorted[i].cell);
+			updateSurface(pos[0], pos[1], pos[2], sorted[i].cell.getType());
+			const int idx[3] = {ix, iy, iz};
+			for(int a = 0; a < 3; a++){
+				if(idx[a] == 0)
+					borders |= 1 << (a * 2);
+				else if(idx[a] == CELLSIZE - 1)
+					borders |= 1 << (a * 2 + 1);
+			}
+			volumeChanged++;
+		}
+		if(!volumeChanged)
+			continue;
+		changed += volumeChanged;
+
+		recordChange(cv);
+		dirtyVolumes[ci].fill();
+		for(int dir = 0; dir < 6; dir++){
+			if(!(borders & 1 << dir))
+				continue;
+			Vec3i ni = ci;
+			ni[dir / 2] += dir % 2 ? 1 : -1;
+			markDirtyBorder(ni, dir ^ 1);
+		}
+	}
+
+	updateDirtyVolumes();
+	return changed;
+}
+
+/// <summary>Sets all Cells in a box.</summary>
+/// <param name="lo">The minimum corner in world indices, inclusive.</param>
+/// <param name="hi">The maximum corner in world indices, exclusive.</param>
+/// <returns>The number of Cells changed.</returns>
+int World::fillBox(const Vec3i &lo, const Vec3i &hi, const Cell &cell){
+	std::vector<CellEdit> edits;
+	for(int ix = lo[0]; ix < hi[0]; ix++) for(int iy = lo[1]; iy < hi[1]; iy++) for(int iz = lo[2]; iz < hi[2]; iz++)
+		edits.push_back(CellEdit(Vec3i(ix, iy, iz), cell));
+	return applyEdits(edits);
+}
+
+/// <summary>Sets all Cells within given distance from a Cell, which digs a spherical cave by default.</summary>
+/// <returns>The number of Cells changed.</returns>
+int World::carveSphere(const Vec3i &center, int radius, const Cell &cell){
+	std::vector<CellEdit> edits;
+	for(int ix = -radius; ix <= radius; ix++) for(int iy = -radius; iy <= radius; iy++) for(int iz = -radius; iz <= radius; iz++)
+		if(ix * ix + iy * iy + iz * iz <= radius * radius)
+			edits.push_back(CellEdit(center + Vec3i(ix, iy, iz), cell));
+	return applyEdits(edits);
+}
+
+/// <summary>Sets Cells along a line between two Cells, both inclusive.</summary>
+/// <remarks>Steps along the longest axis one Cell at a time, like Bresenham's algorithm,
+/// so the line has no gaps and no doubled Cells.</remarks>
+/// <returns>The number of Cells changed.</returns>
+int World::drawLine(const Vec3i &from, const Vec3i &to, const Cell &cell){
+	Vec3i delta = to - from;
+	int steps = std::max(abs(delta[0]), std::max(abs(delta[1]), abs(delta[2])));
+	std::vector<CellEdit> edits;
+	for(int i = 0; i <= steps; i++){
+		Vec3i pos = from;
+		for(int a = 0; a < 3; a++){
+			// Round to nearest with integers, symmetric around zero.
+			int num = delta[a] * i * 2;
+			pos[a] += steps == 0 ? 0 : (num < 0 ? -((-num + steps) / (steps * 2)) : (num + steps) / (steps * 2));
+		}
+		edits.push_back(CellEdit(pos, cell));
+	}
+	return applyEdits(edits);
+}
+
+/// <summary>Copies types of Cells in a box.</summary>
+/// <param name="lo">The minimum corner in world indices, inclusive.</param>
+/// <param name="hi">The maximum corner in world indices, exclusive.</param>
+/// <remarks>Cells in CellVolumes that are not resident are copied as Air.</remarks>
+void World::copyRegion(const Vec3i &lo, const Vec3i &hi, CellRegion &region)const{
+	for(int a = 0; a < 3; a++)
+		region.size[a] = std::max(0, hi[a] - lo[a]);
+	region.types.assign(region.size[0] * region.size[1] * region.size[2], (unsigned char)Cell::Air);
+
+	// Walk CellVolumes overlapping the box so that each is looked up once.
+	Vec3i clo = LessVolume::volumeIndex(lo);
+	Vec3i chi = LessVolume::volumeIndex(hi - Vec3i(1, 1, 1));
+	for(int cx = clo[0]; cx <= chi[0]; cx++) for(int cy = clo[1]; cy <= chi[1]; cy++) for(int cz = clo[2]; cz <= chi[2]; cz++){
+		VolumeMap::const_iterator it = volume.find(Vec3i(cx, cy, cz));
+		if(it == volume.end())
+			continue;
+		const CellVolume &cv = it->second;
+		Vec3i base(cx * CELLSIZE, cy * CELLSIZE, cz * CELLSIZE);
+		Vec3i b, e;
+		for(int a = 0; a < 3; a++){
+			b[a] = std::max(lo[a], base[a]);
+			e[a] = std::min(hi[a], base[a] + CELLSIZE);
+		}
+		for(int ix = b[0]; ix < e[0]; ix++) for(int iy = b[1]; iy < e[1]; iy++) for(int iz = b[2]; iz < e[2]; iz++){
+			region.types[((ix - lo[0]) * region.size[1] + iy - lo[1]) * region.size[2] + iz - lo[2]]
+				= (unsigned char)cv(ix - base[0], iy - base[1], iz - base[2]).getType();
+		}
+	}
+}
+
+/// <summary>Sets Cells from a copied region with its minimum corner at given world indices.</summary>
+/// <param name="skipAir">If true, Air in the region leaves existing Cells as they are, which is handy for placing structures.</param>
+/// <returns>The number of Cells changed.</returns>
+int World::pasteRegion(const CellRegion &region, const Vec3i &pos, bool skipAir){
+	std::vector<CellEdit> edits;
+	for(int ix = 0; ix < region.size[0]; ix++) for(int iy = 0; iy < region.size[1]; iy++) for(int iz = 0; iz < region.size[2]; iz++){
+		Cell::Type type = region.get(ix, iy, iz);
+		if(skipAir && type == Cell::Air)
+			continue;
+		edits.push_back(CellEdit(pos + Vec3i(ix, iy, iz), Cell(type)));
+	}
+	return applyEdits(edits);
+}
+
+}
@@ -62,7 +62,7 @@ const byte Game::saveFileSignature[] = { 0x55, 0x0f, 0x0c, 0xd0, 0xa3, 0x6f, 0x7
 /// <summary>
 /// The current version of this program's save file.
 /// </summary>
-const int Game::saveFileVersion = 1;
+const int Game::saveFileVersion = 2;
 
 #define D3DFVF_CUSTOMVERTEX (D3DFVF_XYZ|D3DFVF_DIFFUSE)
 
@@ -465,9 +465,6 @@ static void display_func(){
 
 	std::ofstream logwriter = std::ofstream("dxtest.log", std::ofstream::app);
 	game.logwriter = &logwriter;
-	CellVolume::cellInvokes = 0;
-	CellVolume::cellForeignInvokes = 0;
-	CellVolume::cellForeignExists = 0;
 
 	if(frame == 0){
 		TimeMeasStart(&tm);
@@ -508,7 +505,8 @@ static void display_func(){
 
 	game.draw(dt);
 
-	logwriter << "cellInvokes = " << CellVolume::cellInvokes << ", cellForeignInvokes = " << CellVolume::cellForeignInvokes << ", cellForeignExists = " << CellVolume::cellForeignExists << std::endl;
+	// Counters of the frame, if the build has instrumentation enabled.
+	Instrument::report(logwriter);
 	game.logwriter = NULL;
 }
 
@@ -575,6 +573,10 @@ void dxtest::Game::draw(double dt)const{
 			if(cv.getSolidCount() == 0)
 				continue;
 
+			// Uniform CellVolumes have no exposed faces after updateCache().
+			if(cv.isUniform())
+				continue;
+
 			// Examine if intersects or included in viewing frustum
 			if(!FrustumCheck((D3DXVECTOR3)World::ind2real(key * CELLSIZE).cast<float>(), (D3DXVECTOR3)World::ind2real((key + Vec3i(1,1,1)) * CELLSIZE).cast<float>(), frustum))
 				continue;
@@ -597,8 +599,10 @@ void dxtest::Game::draw(double dt)const{
 				for(int iz = 0; iz < CELLSIZE; iz++){
 					// This detail culling is not much effective.
 					//if (bf.Contains(new BoundingBox(ind2real(keyindex + new Vec3i(ix, kv.Value.scanLines[ix, iz, 0], iz)), ind2real(keyindex + new Vec3i(ix + 1, kv.Value.scanLines[ix, iz, 1] + 1, iz + 1)))) != ContainmentType.Disjoint)
-					const int (&scanLines)[CELLSIZE][CELLSIZE][2] = cv.getScanLines();
-					for (int iy = scanLines[ix][iz][0]; iy < scanLines[ix][iz][1]; iy++){
+					// Walk only the Cells that need drawing, skipping caves between them.
+					const CellVolume::ColumnMasksType &columns = cv.getColumnMasks();
+					for(unsigned bits = columns[ix][iz]; bits; bits &= bits - 1){
+						int iy = bitScanForward(bits);
 
 						// Cull too far Cells
 						if (cv(ix, iy, iz).getType() == Cell::Air)
@@ -611,15 +615,17 @@ void dxtest::Game::draw(double dt)const{
 							continue;
 
 						// If the Cell is buried under ground, it's no use examining each face of the Cell.
-						if(6 <= cv(ix, iy, iz).getAdjacents())
+						// Exposed faces are cached by updateCache(), so we need not look up neighbors.
+						int faces = cv.getSolidFaces(ix, iy, iz);
+						if(!faces)
 							continue;
 
-						bool x0 = !cv(ix - 1, iy, iz).isTranslucent();
-						bool x1 = !cv(ix + 1, iy, iz).isTranslucent();
-						bool y0 = !cv(ix, iy - 1, iz).isTranslucent();
-						bool y1 = !cv(ix, iy + 1, iz).isTranslucent();
-						bool z0 = !cv(ix, iy, iz - 1).isTranslucent();
-						bool z1 = !cv(ix, iy, iz + 1).isTranslucent();
+						bool x0 = !(faces & 1);
+						bool x1 = !(faces & 2);
+						bool y0 = !(faces & 4);
+						bool y1 = !(faces & 8);
+						bool z0 = !(faces & 16);
+						bool z1 = !(faces & 32);
 						const Cell &cell = cv(ix, iy, iz);
 						pdev->SetTexture(0, g_pTextures[cell.getType() & ~Cell::HalfBit]);
 						D3DXMatrixTranslation(&matWorld,
@@ -672,8 +678,13 @@ void dxtest::Game::draw(double dt)const{
 			const Vec3i &key = it->first;
 			CellVolume &cv = it->second;
 
-			// If all content is air, skip drawing
-			if(cv.getSolidCount() == 0)
+			// Only water is drawn in this pass, so CellVolumes without it are skipped,
+			// while those with water but no solid Cells are not.
+			if(!cv.hasWater())
+				continue;
+
+			// Uniform CellVolumes have no exposed faces after updateCache().
+			if(cv.isUniform())
 				continue;
 
 			// Examine if intersects or included in viewing frustum
@@ -698,8 +709,9 @@ void dxtest::Game::draw(double dt)const{
 				for(int iz = 0; iz < CELLSIZE; iz++){
 					// This detail culling is not much effective.
 					//if (bf.Contains(new BoundingBox(ind2real(keyindex + new Vec3i(ix, kv.Value.scanLines[ix, iz, 0], iz)), ind2real(keyindex + new Vec3i(ix + 1, kv.Value.scanLines[ix, iz, 1] + 1, iz + 1)))) != ContainmentType.Disjoint)
-					const int (&scanLines)[CELLSIZE][CELLSIZE][2] = cv.getTranScanLines();
-					for (int iy = scanLines[ix][iz][0]; iy < scanLines[ix][iz][1]; iy++){
+					const CellVolume::ColumnMasksType &columns = cv.getTranColumnMasks();
+					for(unsigned bits = columns[ix][iz]; bits; bits &= bits - 1){
+						int iy = bitScanForward(bits);
 						const Cell &cell = cv(ix, iy, iz);
 						all++;
 
@@ -714,27 +726,22 @@ void dxtest::Game::draw(double dt)const{
 							continue;
 
 						// If the Cell is buried under ground, it's no use examining each face of the Cell.
-						if(6 <= cell.getAdjacents())
+						// Water faces are drawn only where they face Air.
+						int faces = cv.getWaterFaces(ix, iy, iz);
+						if(!faces)
 							continue;
 
-						bool x0 = !cv(ix - 1, iy, iz).isTranslucent();
-						bool x1 = !cv(ix + 1, iy, iz).isTranslucent();
-						bool y0 = !cv(ix, iy - 1, iz).isTranslucent();
-						bool y1 = !cv(ix, iy + 1, iz).isTranslucent();
-						bool z0 = !cv(ix, iy, iz - 1).isTranslucent();
-						bool z1 = !cv(ix, iy, iz + 1).isTranslucent();
+						bool x0 = !(faces & 1);
+						bool x1 = !(faces & 2);
+						bool y0 = !(faces & 4);
+						bool y1 = !(faces & 8);
+						bool z0 = !(faces & 16);
+						bool z1 = !(faces & 32);
 						D3DXMatrixTranslation(&matWorld,
 							it->first[0] * CELLSIZE + (ix - CELLSIZE / 2),
 							it->first[1] * CELLSIZE + (iy - CELLSIZE / 2),
 							it->first[2] * CELLSIZE + (iz - CELLSIZE / 2));
 
-						x0 |= cv(ix - 1, iy, iz).getType() != cell.Air;
-						x1 |= cv(ix + 1, iy, iz).getType() != cell.Air;
-						y0 |= cv(ix, iy - 1, iz).getType() != cell.Air;
-						y1 |= cv(ix, iy + 1, iz).getType() != cell.Air;
-						z0 |= cv(ix, iy, iz - 1).getType() != cell.Air;
-						z1 |= cv(ix, iy, iz + 1).getType() != cell.Air;
-
 						pdev->SetTransform(D3DTS_WORLD, &matWorld);
 
 						if(!x0 && !x1 && !y0 && !y1)
@@ -808,6 +815,8 @@ void dxtest::Game::draw(double dt)const{
 		g_font->DrawTextA(NULL, dstring() << "bricks: " << player->bricks[1] << ", " << player->bricks[2] << ", " << player->bricks[3] << ", " << player->bricks[4], -1, &rct, 0, D3DCOLOR_ARGB(255, 255, 25, 25));
 		rct.top += 20, rct.bottom += 20;
 		g_font->DrawTextA(NULL, dstring() << "abund: " << world->getBricks(1) << ", " << world->getBricks(2) << ", " << world->getBricks(3) << ", " << world->getBricks(4) << ", " << world->getBricks(5), -1, &rct, 0, D3DCOLOR_ARGB(255, 255, 25, 25));
+		rct.top += 20, rct.bottom += 20;
+		g_font->DrawTextA(NULL, dstring() << "volumes: " << world->getResidentVolumes() << " resident, " << world->getEvictedVolumes() << " evicted, " << world->getReloadedVolumes() << " reloaded", -1, &rct, 0, D3DCOLOR_ARGB(255, 255, 25, 25));
 //		rct.top += 20, rct.bottom += 20;
 //		g_font->DrawTextA(NULL, dstring() << "pass/all: " << pass << "/" << all, -1, &rct, 0, D3DCOLOR_ARGB(255, 255, 25, 25));
 
@@ -835,90 +844,22 @@ void Game::drawMiniMap(double dt)const{
 	D3DXMATRIX mat, matscale, mattrans;
 	static const int mapCellSize = 8;
 	static const int mapCells = 128 / mapCellSize;
-	static const int mapCellVolumes = (mapCells + CELLSIZE - 1) / CELLSIZE;
 	static const int mapHeightRange = 16;
-	static const int mapHeightCellVolumes = (mapHeightRange + CELLSIZE - 1) / CELLSIZE;
 	const int cx = windowWidth - 128;
 	static const int cy = 128;
 	D3DRECT drMap = {cx - 128, cy - 128, cx + 128, cy + 128};
 
-	// Minimize CellVolume search by accumulating height and cell reference to this buffer.
-	// TODO: Dynamic scaling
-	int heights[mapCells * 2][mapCells * 2] = {0};
-	const Cell *cells[mapCells * 2][mapCells * 2] = {NULL};
-	
 	// Fill the background with void color.
 	pdev->Clear(1, &drMap, D3DCLEAR_TARGET, D3DCOLOR_XRGB(0, 0, 63), 0.0f, 0);
 
+	// The surface heightmap gives the top-most cell of each column without scanning CellVolumes.
 	const Vec3i pos = world->real2ind(player->pos);
-	const Vec3i cvpos = VecSignDiv(pos, CELLSIZE);
-	for(int cvx = cvpos[0] - mapCellVolumes; cvx <= cvpos[0] + mapCellVolumes; cvx++) for(int cvz = cvpos[2] - mapCellVolumes; cvz <= cvpos[2] + mapCellVolumes; cvz++){
-		for(int cvy = cvpos[1] + mapHeightCellVolumes; cvpos[1] - mapHeightCellVolumes <= cvy; cvy--){
-
-			// Find CellVolume of interest.
-			Vec3i dpos = Vec3i(cvx, cvy, cvz);
-			World::VolumeMap::iterator it = world->volume.find(dpos);
-			if(it == world->volume.end())
-				continue;
-			CellVolume &cv = it->second;
-
-			// Find up CellVolume prior to process to prevent lookup per every scanline.
-			World::VolumeMap::iterator upit = world->volume.find(Vec3i(cvx, cvy + 1, cvz));
-
-			// Obtain local position
-			const Vec3i lpos = pos - dpos * CELLSIZE;
-
-			const int maxiy = std::min(lpos[1] + mapHeightRange, CELLSIZE - 1);
-
-			for(int ix = std::max(0, lpos[0] - mapCells); ix < std::min(CELLSIZE, lpos[0] + mapCells); ix++){
-				for(int iz = std::max(0, lpos[2] - mapCells); iz < std::min(CELLSIZE, lpos[2] + mapCells); iz++){
-					// Utilizing scanlines for finding cell height for mini map will greatly reduce lookup time.
-					const int (&scanLine)[2] = cv.getScanLines()[ix][iz];
-					const int (&tranScanLine)[2] = cv.getTranScanLines()[ix][iz];
-
-					// Start from one cell up of the scanline's top, Y axis descending order.
-					// Scan line's end position is exclusive, so NOT subtracting 1 from scanLine[1] makes it
-					// begin from excess cell.
-					int iy = std::min(lpos[1] + mapHeightRange, std::max(scanLine[1], tranScanLine[1]));
-					bool space = false;
-
-					// If the excess cell exceeds border of this CellVolume, query the up CellVolume whether it's
-					// a air cell.
-					if(iy == CELLSIZE){
-						if(upit == world->volume.end() || upit->second(ix, 0, iz).getType() == Cell::Air)
-							space = true;
-						iy--;
-					}
-
-					// Descending scan to find the first boundary of air cell and other types of cells.
-					for(; std::max(lpos[1] - mapHeightRange, std::min(scanLine[0], tranScanLine[0])) <= iy; iy--){
-						if(cv(ix, iy, iz).getType() != Cell::Air){
-							if(space){
-								int rx = ix + cvx * CELLSIZE - pos[0] + mapCells;
-								int ry = iy + cvy * CELLSIZE - pos[1] + mapHeightRange;
-								int rz = iz + cvz * CELLSIZE - pos[2] + mapCells;
-								if(heights[rx][rz] < ry){
-									heights[rx][rz] = ry;
-									cells[rx][rz] = &cv(ix, iy, iz);
-								}
-								break;
-							}
-						}
-						else
-							space = true;
-					}
-				}
-			}
-		}
-	}
-//		if(iy == pos[1] + mapHeightRange/*scanLine[1]*/)
-//			continue;
-
 	for(int ix = 0; ix < mapCells * 2; ix++) for(int iz = 0; iz < mapCells * 2; iz++){
-		if(!cells[ix][iz])
+		const int surface = world->surfaceHeight(pos[0] + ix - mapCells, pos[2] + iz - mapCells);
+		if(surface <= pos[1] - mapHeightRange || pos[1] + mapHeightRange < surface)
 			continue;
-		const Cell &cell = *cells[ix][iz]/*world->cell(ix, iy, iz)*//*cv(ipos[0], iy, ipos[2])*/;
-		const TextureData &tex = textureData[cell.getType() & ~Cell::HalfBit];
+		const int height = surface - pos[1] + mapHeightRange;
+		const TextureData &tex = textureData[world->surfaceType(pos[0] + ix - mapCells, pos[2] + iz - mapCells) & ~Cell::HalfBit];
 
 		D3DXMatrixScaling( &matscale, tex.scale * mapCellSize / 64, tex.scale * mapCellSize / 64, 1. );
 		D3DXMatrixTranslation(&mattrans, cx + (ix - mapCells) * mapCellSize, cy + (iz - mapCells) * mapCellSize, 0);
@@ -926,7 +867,7 @@ void Game::drawMiniMap(double dt)const{
 		g_sprite->SetTransform(&mat);
 		g_sprite->Begin(D3DXSPRITE_ALPHABLEND);
 		RECT srcrect = {0, 0, tex.size, tex.size};
-		int col = (heights[ix][iz]) * 128 / (2 * mapHeightRange) + 127;
+		int col = height * 128 / (2 * mapHeightRange) + 127;
 		g_sprite->Draw(g_pTextures[tex.index], &srcrect, NULL, &D3DXVECTOR3(0, 0, 0),
 			D3DCOLOR_ARGB(255,col,col,col));
 		g_sprite->End();
@@ -1143,13 +1084,14 @@ void dxtest::Game::unserialize(std::istream &is){
 
     int version;
 	is.read((char*)&version, sizeof version);
-	if(version != saveFileVersion){
+	// Version 1 lacks World::generator but is otherwise the same.
+	if(version < 1 || saveFileVersion < version){
 		std::stringstream ss;
 		ss << "File version mismatch, file = " << version << ", program = " << saveFileVersion;
 		throw std::exception(ss.str().c_str());
 	}
 
 	player->unserialize(is);
-	world->unserialize(is);
+	world->unserialize(is, version);
 }
 
@@ -81,6 +81,7 @@ void perlin_noise(const PerlinNoiseParams &param, PerlinNoiseCallback &callback)
 
 	double persistence = param.persistence;
 	int work2[CELLSIZE][CELLSIZE] = {0};
+	unsigned long lattice[CELLSIZE + 2][CELLSIZE + 2]; // Lattice values of an octave, from the lowest lattice point
 	int octave;
 	int xi, yi;
 
@@ -94,19 +95,30 @@ void perlin_noise(const PerlinNoiseParams &param, PerlinNoiseCallback &callback)
 			for(xi = 0; xi < CELLSIZE; xi++) for(yi = 0; yi < CELLSIZE; yi++)
 				work2[xi][yi] = Random(param.seed, (xi + param.xofs), (yi + param.yofs)).next();
 		}
-		else for(xi = 0; xi < CELLSIZE; xi++) for(yi = 0; yi < CELLSIZE; yi++){
-			int xj, yj;
-			double sum = 0;
-			int xsm = SignModulo(xi + param.xofs, cell);
-			int ysm = SignModulo(yi + param.yofs, cell);
-			int xsd = SignDiv(xi + param.xofs, cell);
-			int ysd = SignDiv(yi + param.yofs, cell);
-			for(xj = 0; xj <= 1; xj++) for(yj = 0; yj <= 1; yj++){
-				sum += (double)(Random(param.seed, (xsd + xj), (ysd + yj)).next())
-				* (xj ? xsm : (cell - xsm - 1)) / (double)cell
-				* (yj ? ysm : (cell - ysm - 1)) / (double)cell;
+		else{
+			// Neighboring samples share lattice points, so hash each lattice point this octave
+			// touches once into a table instead of four times per sample.
+			int x0 = SignDiv(param.xofs, cell);
+			int y0 = SignDiv(param.yofs, cell);
+			int nx = SignDiv(param.xofs + CELLSIZE - 1, cell) - x0 + 2;
+			int ny = SignDiv(param.yofs + CELLSIZE - 1, cell) - y0 + 2;
+			for(int lx = 0; lx < nx; lx++) for(int ly = 0; ly < ny; ly++)
+				lattice[lx][ly] = Random(param.seed, x0 + lx, y0 + ly).next();
+
+			for(xi = 0; xi < CELLSIZE; xi++) for(yi = 0; yi < CELLSIZE; yi++){
+				int xj, yj;
+				double sum = 0;
+				int xsm = SignModulo(xi + param.xofs, cell);
+				int ysm = SignModulo(yi + param.yofs, cell);
+				int xsd = SignDiv(xi + param.xofs, cell) - x0;
+				int ysd = SignDiv(yi + param.yofs, cell) - y0;
+				for(xj = 0; xj <= 1; xj++) for(yj = 0; yj <= 1; yj++){
+					sum += (double)(lattice[xsd + xj][ysd + yj])
+					* (xj ? xsm : (cell - xsm - 1)) / (double)cell
+					* (yj ? ysm : (cell - ysm - 1)) / (double)cell;
+				}
+				work2[xi][yi] += (int)(sum * factor);
 			}
-			work2[xi][yi] += (int)(sum * factor);
 		}
 		sumfactor += factor;
 		factor /= param.persistence;
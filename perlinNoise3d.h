@@ -37,6 +37,43 @@ public:
 	void operator()(int f, double maxi, int ix, int iy, int iz){
 		field[ix][iy][iz] = float(f / maxi);
 	}
+	void operator()(float f, int ix, int iy, int iz){
+		field[ix][iy][iz] = f;
+	}
+};
+
+/// \brief Callback object that will assign noise values of channels to a float 3-d array field,
+/// interleaving the channels of each voxel.
+///
+/// The field may have more channels than are generated, in which case generated channels are
+/// assigned to consecutive channels of the field from first.
+template<int CELLSIZE, int N>
+class FieldAssignChannels3D{
+	typedef float (&fieldType)[CELLSIZE][CELLSIZE][CELLSIZE][N];
+	fieldType field;
+	int first;
+public:
+	FieldAssignChannels3D(fieldType field, int first = 0) : field(field), first(first){}
+	void operator()(int c, int f, double maxi, int ix, int iy, int iz){
+		field[ix][iy][iz][first + c] = float(f / maxi);
+	}
+	void operator()(int c, float f, int ix, int iy, int iz){
+		field[ix][iy][iz][first + c] = f;
+	}
+};
+
+/// \brief Adapts a callback of a single field to generators of channels, which pass the channel first.
+template<typename Callback>
+class SingleChannel{
+	Callback &callback;
+public:
+	SingleChannel(Callback &callback) : callback(callback){}
+	void operator()(int, int f, double maxi, int ix, int iy, int iz){
+		callback(f, maxi, ix, iy, iz);
+	}
+	void operator()(int, float f, int ix, int iy, int iz){
+		callback(f, ix, iy, iz);
+	}
 };
 
 /// \brief Parameters given to perlin_noise_3D(), sharing common parameters with 2D.
@@ -73,13 +110,18 @@ inline void perlin_noise_3D(long seed, PerlinNoiseCallback &callback, int xofs =
   c ^= b; c -= rot(b,24); \
 }
 
-/// \brief Generate Perlin Noise and return it through callback.
+/// \brief Generate channels of Perlin Noise that differ only in seeds in one pass and return them through callback.
 /// \param CELLSIZE The cell size in voxels.
-/// \param Callback The type for callback object. Can be a function or a functionoid.
-/// \param param Parameters to generate the noise.
-/// \param callback Callback object to receive the result.
-template<int CELLSIZE, typename Callback>
-void perlin_noise_3D(const PerlinNoiseParams3D &param, Callback &callback){
+/// \param N The number of channels.
+/// \param Callback The type for callback object, which receives the channel index before the arguments of perlin_noise_3D().
+/// \param param Parameters to generate the noise, whose seed is ignored.
+/// \param seeds The seed of each channel.
+/// \param callback Callback object to receive the result, called for all channels of a voxel before the next voxel.
+///
+/// Each channel is the same as perlin_noise_3D() with its seed, but the interpolation weights
+/// and lattice indices are computed once for all channels.
+template<int CELLSIZE, int N, typename Callback>
+void perlin_noise_3D_channels(const PerlinNoiseParams3D &param, const unsigned long (&seeds)[N], Callback &callback){
 	static const int baseMax = 255;
 
 	struct Random{
@@ -122,10 +164,12 @@ void perlin_noise_3D(const PerlinNoiseParams3D &param, Callback &callback){
 		}
 	};
 
-	double persistence = param.persistence;
-	int work2[CELLSIZE][CELLSIZE][CELLSIZE] = {0};
+	int work2[N][CELLSIZE][CELLSIZE][CELLSIZE] = {0};
+	// Lattice values of an octave, from the lowest lattice point.  They never exceed baseMax.
+	unsigned char lattice[N][CELLSIZE + 2][CELLSIZE + 2][CELLSIZE + 2];
 	int octave;
 	int xi, yi, zi;
+	int c;
 
 	double factor = 1.0;
 	double sumfactor = 0.0;
@@ -134,38 +178,56 @@ void perlin_noise_3D(const PerlinNoiseParams3D &param, Callback &callback){
 	for(octave = 0; octave < param.octaves; octave += 1){
 		int cell = 1 << octave;
 		if(octave == 0){
-			for(xi = 0; xi < CELLSIZE; xi++) for(yi = 0; yi < CELLSIZE; yi++) for(zi = 0; zi < CELLSIZE; zi++)
-				work2[xi][yi][zi] = Random::gen(param.seed, (xi + param.xofs), (yi + param.yofs), zi + param.zofs);
+			for(c = 0; c < N; c++)
+				for(xi = 0; xi < CELLSIZE; xi++) for(yi = 0; yi < CELLSIZE; yi++) for(zi = 0; zi < CELLSIZE; zi++)
+					work2[c][xi][yi][zi] = Random::gen(seeds[c], (xi + param.xofs), (yi + param.yofs), zi + param.zofs);
 		}
-		else for(xi = 0; xi < CELLSIZE; xi++) for(yi = 0; yi < CELLSIZE; yi++) for(zi = 0; zi < CELLSIZE; zi++){
-			int xj, yj, zj;
-			double sum = 0;
-			int xsm = SignModulo(xi + param.xofs, cell);
-			int ysm = SignModulo(yi + param.yofs, cell);
-			int zsm = SignModulo(zi + param.zofs, cell);
-			int xsd = SignDiv(xi + param.xofs, cell);
-			int ysd = SignDiv(yi + param.yofs, cell);
-			int zsd = SignDiv(zi + param.zofs, cell);
-			for(xj = 0; xj <= 1; xj++){
-				int xfactor = xj ? xsm : (cell - xsm - 1);
-				if(xfactor == 0) // Skip rest of this iteration if factor is 0
-					continue;
-				for(yj = 0; yj <= 1; yj++){
-					int yfactor = yj ? ysm : (cell - ysm - 1);
-					if(yfactor == 0) // Skip rest of this iteration if factor is 0
+		else{
+			// Neighboring samples share lattice points, so hash each lattice point this octave
+			// touches once into a table instead of up to eight times per sample.
+			int x0 = SignDiv(param.xofs, cell);
+			int y0 = SignDiv(param.yofs, cell);
+			int z0 = SignDiv(param.zofs, cell);
+			int nx = SignDiv(param.xofs + CELLSIZE - 1, cell) - x0 + 2;
+			int ny = SignDiv(param.yofs + CELLSIZE - 1, cell) - y0 + 2;
+			int nz = SignDiv(param.zofs + CELLSIZE - 1, cell) - z0 + 2;
+			for(c = 0; c < N; c++)
+				for(int lx = 0; lx < nx; lx++) for(int ly = 0; ly < ny; ly++) for(int lz = 0; lz < nz; lz++)
+					lattice[c][lx][ly][lz] = (unsigned char)Random::gen(seeds[c], x0 + lx, y0 + ly, z0 + lz);
+
+			for(xi = 0; xi < CELLSIZE; xi++) for(yi = 0; yi < CELLSIZE; yi++) for(zi = 0; zi < CELLSIZE; zi++){
+				int xj, yj, zj;
+				double sum[N] = {0};
+				int xsm = SignModulo(xi + param.xofs, cell);
+				int ysm = SignModulo(yi + param.yofs, cell);
+				int zsm = SignModulo(zi + param.zofs, cell);
+				int xsd = SignDiv(xi + param.xofs, cell) - x0;
+				int ysd = SignDiv(yi + param.yofs, cell) - y0;
+				int zsd = SignDiv(zi + param.zofs, cell) - z0;
+				for(xj = 0; xj <= 1; xj++){
+					int xfactor = xj ? xsm : (cell - xsm - 1);
+					if(xfactor == 0) // Skip rest of this iteration if factor is 0
 						continue;
-					for(zj = 0; zj <= 1; zj++){
-						int zfactor = zj ? zsm : (cell - zsm - 1);
-						if(zfactor == 0) // Skip rest of this iteration if factor is 0
+					for(yj = 0; yj <= 1; yj++){
+						int yfactor = yj ? ysm : (cell - ysm - 1);
+						if(yfactor == 0) // Skip rest of this iteration if factor is 0
 							continue;
-						sum += (double)(Random::gen(param.seed, (xsd + xj), (ysd + yj), zsd + zj))
-						* xfactor / (double)cell
-						* yfactor / (double)cell
-						* zfactor / (double)cell;
+						for(zj = 0; zj <= 1; zj++){
+							int zfactor = zj ? zsm : (cell - zsm - 1);
+							if(zfactor == 0) // Skip rest of this iteration if factor is 0
+								continue;
+							for(c = 0; c < N; c++){
+								sum[c] += (double)(lattice[c][xsd + xj][ysd + yj][zsd + zj])
+								* xfactor / (double)cell
+								* yfactor / (double)cell
+								* zfactor / (double)cell;
+							}
+						}
 					}
 				}
+				for(c = 0; c < N; c++)
+					work2[c][xi][yi][zi] += (int)(sum[c] * factor);
 			}
-			work2[xi][yi][zi] += (int)(sum * factor);
 		}
 		sumfactor += factor;
 		factor /= param.persistence;
@@ -173,10 +235,23 @@ void perlin_noise_3D(const PerlinNoiseParams3D &param, Callback &callback){
 
 	// Return result
 	for(int xi = 0; xi < CELLSIZE; xi++) for(int yi = 0; yi < CELLSIZE; yi++) for(int zi = 0; zi < CELLSIZE; zi++){
-		callback(work2[xi][yi][zi], baseMax * sumfactor, xi, yi, zi);
+		for(int c = 0; c < N; c++)
+			callback(c, work2[c][xi][yi][zi], baseMax * sumfactor, xi, yi, zi);
 	}
 }
 
+/// \brief Generate Perlin Noise and return it through callback.
+/// \param CELLSIZE The cell size in voxels.
+/// \param Callback The type for callback object. Can be a function or a functionoid.
+/// \param param Parameters to generate the noise.
+/// \param callback Callback object to receive the result.
+template<int CELLSIZE, typename Callback>
+void perlin_noise_3D(const PerlinNoiseParams3D &param, Callback &callback){
+	const unsigned long seeds[1] = {(unsigned long)param.seed};
+	SingleChannel<Callback> channel(callback);
+	perlin_noise_3D_channels<CELLSIZE>(param, seeds, channel);
+}
+
 }
 
 #endif
@@ -0,0 +1,245 @@
+#ifndef PERLINNOISE3DHASHED_H
+#define PERLINNOISE3DHASHED_H
+/** \file
+ * \brief Defines perlin_noise_3D_hashed(), a vectorized variant of perlin_noise_3D().
+ *
+ * perlin_noise_3D() hashes lattice points by seeding a RandomSequence, which carries state
+ * between steps and cannot be evaluated for several points at once, and interpolates in double.
+ * The hashed variant uses a stateless integer hash of 32-bit multiplications, shifts and
+ * exclusive ors, and accumulates in float, so a row of samples along Z is evaluated in vector
+ * registers: 8 samples per instruction with AVX2, 4 with SSE4.1, one at a time otherwise.
+ *
+ * Every lane performs the same single precision operations in the same order whichever kernel
+ * is compiled in, so the noise does not depend on the instruction set.  It does differ from
+ * perlin_noise_3D() though, so World::generator selects between the two.
+ */
+
+#include "SignModulo.h"
+#include "perlinNoise3d.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+
+namespace PerlinNoise{
+
+/// \brief Lane operations of the hashed noise kernel, a sample at a time.
+struct ScalarLanes{
+	typedef unsigned VI;
+	typedef float VF;
+	static const int width = 1;
+	static VI set1(unsigned a){return a;}
+	static VI iota(int base){return VI(base);} ///< Consecutive values from base in the lanes
+	static VI add(VI a, VI b){return a + b;}
+	static VI sub(VI a, VI b){return a - b;}
+	static VI mul(VI a, VI b){return a * b;}
+	static VI xor_(VI a, VI b){return a ^ b;}
+	static VI and_(VI a, VI b){return a & b;}
+	template<int n> static VI srl(VI a){return a >> n;}
+	static VI sra(VI a, int n){return VI(int(a) >> n);}
+	static VF set1f(float a){return a;}
+	static VF cvt(VI a){return float(int(a));}
+	static VF addf(VF a, VF b){return a + b;}
+	static VF mulf(VF a, VF b){return a * b;}
+	static VF loadf(const float *p){return *p;}
+	static void storef(float *p, VF a){*p = a;}
+};
+
+#if defined(__AVX2__)
+/// \brief Lane operations of the hashed noise kernel, 8 samples at a time.
+struct Avx2Lanes{
+	typedef __m256i VI;
+	typedef __m256 VF;
+	static const int width = 8;
+	static VI set1(unsigned a){return _mm256_set1_epi32(int(a));}
+	static VI iota(int base){return _mm256_add_epi32(_mm256_set1_epi32(base), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));}
+	static VI add(VI a, VI b){return _mm256_add_epi32(a, b);}
+	static VI sub(VI a, VI b){return _mm256_sub_epi32(a, b);}
+	static VI mul(VI a, VI b){return _mm256_mullo_epi32(a, b);}
+	static VI xor_(VI a, VI b){return _mm256_xor_si256(a, b);}
+	static VI and_(VI a, VI b){return _mm256_and_si256(a, b);}
+	template<int n> static VI srl(VI a){return _mm256_srli_epi32(a, n);}
+	static VI sra(VI a, int n){return _mm256_sra_epi32(a, _mm_cvtsi32_si128(n));}
+	static VF set1f(float a){return _mm256_set1_ps(a);}
+	static VF cvt(VI a){return _mm256_cvtepi32_ps(a);}
+	static VF addf(VF a, VF b){return _mm256_add_ps(a, b);}
+	static VF mulf(VF a, VF b){return _mm256_mul_ps(a, b);}
+	static VF loadf(const float *p){return _mm256_loadu_ps(p);}
+	static void storef(float *p, VF a){_mm256_storeu_ps(p, a);}
+};
+typedef Avx2Lanes NoiseLanes;
+#elif defined(__SSE4_1__)
+/// \brief Lane operations of the hashed noise kernel, 4 samples at a time.
+struct Sse4Lanes{
+	typedef __m128i VI;
+	typedef __m128 VF;
+	static const int width = 4;
+	static VI set1(unsigned a){return _mm_set1_epi32(int(a));}
+	static VI iota(int base){return _mm_add_epi32(_mm_set1_epi32(base), _mm_setr_epi32(0, 1, 2, 3));}
+	static VI add(VI a, VI b){return _mm_add_epi32(a, b);}
+	static VI sub(VI a, VI b){return _mm_sub_epi32(a, b);}
+	static VI mul(VI a, VI b){return _mm_mullo_epi32(a, b);}
+	static VI xor_(VI a, VI b){return _mm_xor_si128(a, b);}
+	static VI and_(VI a, VI b){return _mm_and_si128(a, b);}
+	template<int n> static VI srl(VI a){return _mm_srli_epi32(a, n);}
+	static VI sra(VI a, int n){return _mm_sra_epi32(a, _mm_cvtsi32_si128(n));}
+	static VF set1f(float a){return _mm_set1_ps(a);}
+	static VF cvt(VI a){return _mm_cvtepi32_ps(a);}
+	static VF addf(VF a, VF b){return _mm_add_ps(a, b);}
+	static VF mulf(VF a, VF b){return _mm_mul_ps(a, b);}
+	static VF loadf(const float *p){return _mm_loadu_ps(p);}
+	static void storef(float *p, VF a){_mm_storeu_ps(p, a);}
+};
+typedef Sse4Lanes NoiseLanes;
+#else
+typedef ScalarLanes NoiseLanes;
+#endif
+
+/// Multipliers that spread lattice coordinates over the hash input.
+static const unsigned HashPrimeX = 0x8da6b343;
+static const unsigned HashPrimeY = 0xd8163841;
+static const unsigned HashPrimeZ = 0xcb1ab31f;
+
+/// \brief Finalizes a hash input into a lattice value between 0 and 255.
+template<typename Lanes>
+inline typename Lanes::VI hashLattice(typename Lanes::VI h){
+	h = Lanes::xor_(h, Lanes::template srl<16>(h));
+	h = Lanes::mul(h, Lanes::set1(0x7feb352d));
+	h = Lanes::xor_(h, Lanes::template srl<15>(h));
+	h = Lanes::mul(h, Lanes::set1(0x846ca68b));
+	h = Lanes::xor_(h, Lanes::template srl<16>(h));
+	return Lanes::template srl<24>(h);
+}
+
+/// \brief Returns the lattice value of perlin_noise_3D_hashed() at a lattice point, between 0 and 255.
+inline unsigned hashLattice(unsigned seed, int x, int y, int z){
+	return hashLattice<ScalarLanes>(seed ^ unsigned(x) * HashPrimeX ^ unsigned(y) * HashPrimeY ^ unsigned(z) * HashPrimeZ);
+}
+
+/// \brief Adds an octave of noise of each channel to a row of Lanes::width samples along Z.
+/// \param seeds Seed of each channel.
+/// \param shift Number of low bits dropped from interpolated sums before converting them to float.
+/// \param scale Weight of the octave divided by the cube of its cell size, times 2 to the shift.
+/// \param x,y,z World coordinates of the first sample.
+/// \param work Accumulated noise of the samples of the first channel.
+/// \param stride Distance in floats from samples of a channel to those of the next.
+///
+/// Lattice values are interpolated in integers with the weights of perlin_noise_3D() scaled by
+/// the cell size, which is exact for up to 8 octaves.  The sums fit in a float mantissa after
+/// the shift, and if scale is a power of two, as it is with a persistence of 0.5, only adding
+/// to work rounds.  So the result is the same with or without fused multiply-add or x87 excess
+/// precision.
+template<typename Lanes, int N>
+inline void accumulateOctave(const unsigned (&seeds)[N], int octave, int shift, float scale, int x, int y, int z, float *work, int stride){
+	typedef typename Lanes::VI VI;
+	const int cell = 1 << octave;
+
+	if(octave == 0){
+		VI hxyz = Lanes::xor_(Lanes::set1(unsigned(x) * HashPrimeX ^ unsigned(y) * HashPrimeY),
+			Lanes::mul(Lanes::iota(z), Lanes::set1(HashPrimeZ)));
+		for(int c = 0; c < N; c++)
+			Lanes::storef(work + c * stride, Lanes::cvt(hashLattice<Lanes>(Lanes::xor_(hxyz, Lanes::set1(seeds[c])))));
+		return;
+	}
+
+	int xsm = SignModulo(x, cell), ysm = SignModulo(y, cell);
+	int xsd = SignDiv(x, cell), ysd = SignDiv(y, cell);
+	const int xfactor[2] = {cell - xsm - 1, xsm};
+	const int yfactor[2] = {cell - ysm - 1, ysm};
+
+	// Floor division and modulo by a power of two are an arithmetic shift and a mask.
+	VI zc = Lanes::iota(z);
+	VI zfactor1 = Lanes::and_(zc, Lanes::set1(cell - 1));
+	VI zfactor0 = Lanes::sub(Lanes::set1(cell - 1), zfactor1);
+	VI hz0 = Lanes::mul(Lanes::sra(zc, octave), Lanes::set1(HashPrimeZ));
+	VI hz1 = Lanes::add(hz0, Lanes::set1(HashPrimeZ));
+
+	VI sum[N];
+	for(int c = 0; c < N; c++)
+		sum[c] = Lanes::set1(0);
+	for(int xj = 0; xj <= 1; xj++){
+		if(xfactor[xj] == 0) // Skip rest of this iteration if factor is 0
+			continue;
+		for(int yj = 0; yj <= 1; yj++){
+			if(yfactor[yj] == 0)
+				continue;
+			unsigned hxy = unsigned(xsd + xj) * HashPrimeX ^ unsigned(ysd + yj) * HashPrimeY;
+			VI wxy = Lanes::set1(xfactor[xj] * yfactor[yj]);
+			for(int c = 0; c < N; c++){
+				VI h = Lanes::set1(seeds[c] ^ hxy);
+				VI v = Lanes::add(Lanes::mul(hashLattice<Lanes>(Lanes::xor_(h, hz0)), zfactor0),
+					Lanes::mul(hashLattice<Lanes>(Lanes::xor_(h, hz1)), zfactor1));
+				sum[c] = Lanes::add(sum[c], Lanes::mul(v, wxy));
+			}
+		}
+	}
+	for(int c = 0; c < N; c++){
+		float *p = work + c * stride;
+		Lanes::storef(p, Lanes::addf(Lanes::loadf(p), Lanes::mulf(Lanes::cvt(Lanes::sra(sum[c], shift)), Lanes::set1f(scale))));
+	}
+}
+
+/// \brief Generate channels of Perlin Noise with the vectorized kernel in one pass and return them through callback.
+/// \param CELLSIZE The cell size in voxels.
+/// \param N The number of channels.
+/// \param Callback The type for callback object, which receives the channel index, a float between 0 and 1 and the voxel indices.
+/// \param param Parameters to generate the noise, whose seed is ignored.
+/// \param seeds The seed of each channel.
+/// \param callback Callback object to receive the result, called for all channels of a voxel before the next voxel.
+///
+/// The octave structure is that of perlin_noise_3D(), but lattice values come from hashLattice().
+/// Each channel is the same as perlin_noise_3D_hashed() with its seed.
+template<int CELLSIZE, int N, typename Callback>
+void perlin_noise_3D_hashed_channels(const PerlinNoiseParams3D &param, const unsigned long (&seeds)[N], Callback &callback){
+	static const int baseMax = 255;
+	const int vectorEnd = CELLSIZE / NoiseLanes::width * NoiseLanes::width;
+	const int stride = CELLSIZE * CELLSIZE * CELLSIZE;
+
+	unsigned seeds32[N];
+	for(int c = 0; c < N; c++)
+		seeds32[c] = unsigned(seeds[c]);
+	float work[N][CELLSIZE][CELLSIZE][CELLSIZE];
+	double factor = 1.0;
+	double sumfactor = 0.0;
+
+	for(int octave = 0; octave < param.octaves; octave++){
+		int cell = 1 << octave;
+		int shift = 0;
+		while((long long)baseMax * (cell - 1) * (cell - 1) * (cell - 1) >> shift >= 1 << 24)
+			shift++;
+		float scale = float(factor / cell / cell / cell * (1 << shift));
+		for(int xi = 0; xi < CELLSIZE; xi++) for(int yi = 0; yi < CELLSIZE; yi++){
+			int zi = 0;
+			for(; zi < vectorEnd; zi += NoiseLanes::width)
+				accumulateOctave<NoiseLanes>(seeds32, octave, shift, scale, xi + param.xofs, yi + param.yofs, zi + param.zofs, &work[0][xi][yi][zi], stride);
+			for(; zi < CELLSIZE; zi++)
+				accumulateOctave<ScalarLanes>(seeds32, octave, shift, scale, xi + param.xofs, yi + param.yofs, zi + param.zofs, &work[0][xi][yi][zi], stride);
+		}
+		sumfactor += factor;
+		factor /= param.persistence;
+	}
+
+	// Return result
+	const float scale = float(1. / (baseMax * sumfactor));
+	for(int xi = 0; xi < CELLSIZE; xi++) for(int yi = 0; yi < CELLSIZE; yi++) for(int zi = 0; zi < CELLSIZE; zi++){
+		for(int c = 0; c < N; c++)
+			callback(c, work[c][xi][yi][zi] * scale, xi, yi, zi);
+	}
+}
+
+/// \brief Generate Perlin Noise with the vectorized kernel and return it through callback.
+/// \param CELLSIZE The cell size in voxels.
+/// \param Callback The type for callback object, which receives a float between 0 and 1 and the voxel indices.
+/// \param param Parameters to generate the noise.
+/// \param callback Callback object to receive the result.
+template<int CELLSIZE, typename Callback>
+void perlin_noise_3D_hashed(const PerlinNoiseParams3D &param, Callback &callback){
+	const unsigned long seeds[1] = {(unsigned long)param.seed};
+	SingleChannel<Callback> channel(callback);
+	perlin_noise_3D_hashed_channels<CELLSIZE>(param, seeds, channel);
+}
+
+}
+
+#endif